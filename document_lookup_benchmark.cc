@@ -0,0 +1,87 @@
+// Compares ways of finding the document containing each suffix, visited in
+// random order as in a suffix array: reading a precomputed array of document
+// indexes, searching the document starts in Eytzinger order, and searching
+// them with std::upper_bound().
+//
+// Usage: document_lookup_benchmark [DOCUMENT-COUNT [LOOKUP-COUNT]]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "eytzinger.h"
+
+namespace {
+
+template <typename Function>
+void Measure(const char* name, size_t lookup_count, Function&& function) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto checksum = function();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-16s %8.3f s %8.2f ns/lookup (checksum %zu)\n", name,
+         elapsed.count(), elapsed.count() * 1e9 / lookup_count, checksum);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t document_count = (argc > 1) ? strtoull(argv[1], nullptr, 0)
+                                           : 2000000;
+  const size_t lookup_count = (argc > 2) ? strtoull(argv[2], nullptr, 0)
+                                         : 20000000;
+
+  std::mt19937_64 rng(1);
+  std::uniform_int_distribution<size_t> length_dist(1, 200);
+
+  std::vector<size_t> document_starts;
+  size_t text_size = 0;
+
+  for (size_t i = 0; i < document_count; ++i) {
+    document_starts.emplace_back(text_size);
+    text_size += length_dist(rng);
+  }
+
+  std::uniform_int_distribution<size_t> offset_dist(0, text_size - 1);
+  std::vector<size_t> offsets(lookup_count);
+  for (auto& offset : offsets) offset = offset_dist(rng);
+
+  const EytzingerArray search(document_starts.data(), document_starts.size());
+
+  const auto find_document = [&search](size_t offset) {
+    return search.CountLess(offset + 1) - 1;
+  };
+
+  std::vector<uint32_t> documents(lookup_count);
+  for (size_t i = 0; i < lookup_count; ++i)
+    documents[i] = find_document(offsets[i]);
+
+  printf("%zu documents, %zu lookups\n", document_count, lookup_count);
+
+  Measure("array", lookup_count, [&documents] {
+    size_t checksum = 0;
+    for (const auto document : documents) checksum += document;
+    return checksum;
+  });
+
+  Measure("eytzinger", lookup_count, [&offsets, &find_document] {
+    size_t checksum = 0;
+    for (const auto offset : offsets) checksum += find_document(offset);
+    return checksum;
+  });
+
+  Measure("upper_bound", lookup_count, [&offsets, &document_starts] {
+    size_t checksum = 0;
+    for (const auto offset : offsets) {
+      checksum += std::upper_bound(document_starts.begin(),
+                                   document_starts.end(), offset) -
+                  document_starts.begin() - 1;
+    }
+    return checksum;
+  });
+}
@@ -18,7 +18,7 @@ parser.add_argument('--sample-size', type=float, default=512,
 parser.add_argument('--seed', type=int, default=1,
     help='Random seed')
 parser.add_argument('--filter', default=False, action='store_true',
-    help='Filter redundant features (expensive)')
+    help='Filter redundant features')
 parser.add_argument('labels', metavar='labels', type=str, nargs=1,
     help='CSV file containg "label" and "file" columns')
 args = parser.parse_args()
@@ -0,0 +1,17 @@
+#include "eytzinger.h"
+
+EytzingerArray::EytzingerArray(const size_t* sorted, size_t size)
+    : values_(size + 1), ranks_(size + 1) {
+  Fill(sorted, 0, 1);
+}
+
+size_t EytzingerArray::Fill(const size_t* sorted, size_t index, size_t node) {
+  if (node >= values_.size()) return index;
+
+  index = Fill(sorted, index, 2 * node);
+
+  values_[node] = sorted[index];
+  ranks_[node] = index;
+
+  return Fill(sorted, index + 1, 2 * node + 1);
+}
@@ -0,0 +1,253 @@
+#include <cstring>
+#include <string>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "substrings.h"
+
+namespace {
+
+const char kIndexMagic[8] = {'S', 'U', 'B', 'S', 'T', 'R', 'I', 'X'};
+
+// Incremented whenever the layout of the index file changes.
+const uint32_t kIndexVersion = 2;
+
+// Sections are aligned to this many bytes.
+const size_t kIndexAlignment = 64;
+
+enum IndexFlags : uint32_t {
+  kIndexWideSuffixes = 1,
+  kIndexColor = 2,
+  kIndexWords = 4,
+};
+
+// The index file starts with this header.  All integers are stored in native
+// byte order, so an index can only be loaded on the same architecture it was
+// built on.
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+
+  uint64_t input0_size;
+  uint64_t input1_size;
+  uint64_t suffix_count;
+  uint64_t shared_prefix_overflow_count;
+  uint64_t document_count;
+  uint64_t input0_doc_count;
+  uint64_t input1_doc_count;
+  uint64_t input0_n_gram_count;
+  uint64_t input1_n_gram_count;
+  uint64_t max_suffix_size;
+
+  // Offsets of each section, relative to the start of the file.
+  uint64_t text_offset;
+  uint64_t suffixes_offset;
+  uint64_t shared_prefixes_offset;
+  uint64_t shared_prefix_overflow_offset;
+  uint64_t document_starts_offset;
+  uint64_t n_gram_counts_offset;
+};
+
+size_t Align(size_t offset) {
+  return (offset + kIndexAlignment - 1) & ~(kIndexAlignment - 1);
+}
+
+// Writes `size` bytes to `fd` at `offset`, first padding the file with zeros
+// up to `offset`.  Exits on failure.
+void WriteSection(int fd, size_t& file_size, size_t offset, const void* data,
+                  size_t size, const std::string& path) {
+  static const char kPadding[kIndexAlignment] = {};
+
+  if (offset > file_size) {
+    if (offset - file_size != static_cast<size_t>(write(
+                                  fd, kPadding, offset - file_size)))
+      err(EX_IOERR, "Write to '%s' failed", path.c_str());
+    file_size = offset;
+  }
+
+  auto ptr = reinterpret_cast<const char*>(data);
+
+  while (size) {
+    const auto ret = write(fd, ptr, size);
+
+    if (ret < 0) err(EX_IOERR, "Write to '%s' failed", path.c_str());
+
+    ptr += ret;
+    size -= ret;
+    file_size += ret;
+  }
+}
+
+}  // namespace
+
+void CommonSubstringFinder::SaveIndex(const char* path) {
+  if (!have_index_) BuildIndex();
+
+  const auto index_size = wide_suffixes_ ? sizeof(int64_t) : sizeof(int32_t);
+  const auto text_size = input0_size + input1_size + 1;
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+  header.version = kIndexVersion;
+  header.flags = (wide_suffixes_ ? kIndexWideSuffixes : 0) |
+                 (do_color ? kIndexColor : 0) | (do_words ? kIndexWords : 0);
+  header.input0_size = input0_size;
+  header.input1_size = input1_size;
+  header.suffix_count = suffix_count_;
+  header.shared_prefix_overflow_count = shared_prefix_overflow_count_;
+  header.document_count = document_count_;
+  header.input0_doc_count = input0_doc_count_;
+  header.input1_doc_count = input1_doc_count_;
+  header.input0_n_gram_count = input0_n_gram_counts_.size();
+  header.input1_n_gram_count = input1_n_gram_counts_.size();
+  header.max_suffix_size = max_suffix_size_;
+
+  header.text_offset = Align(sizeof(header));
+  header.suffixes_offset = Align(header.text_offset + text_size);
+  header.shared_prefixes_offset =
+      Align(header.suffixes_offset + suffix_count_ * index_size);
+  header.shared_prefix_overflow_offset =
+      Align(header.shared_prefixes_offset + suffix_count_);
+  header.document_starts_offset =
+      Align(header.shared_prefix_overflow_offset +
+            shared_prefix_overflow_count_ * sizeof(*shared_prefix_overflow_));
+  header.n_gram_counts_offset =
+      Align(header.document_starts_offset + document_count_ * sizeof(size_t));
+
+  // Write to a temporary file first, so that processes that have the old
+  // index mapped aren't affected.
+  const auto tmp_path = std::string(path) + ".tmp";
+
+  int fd;
+  if (-1 == (fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)))
+    err(EX_CANTCREAT, "Could not open '%s' for writing", tmp_path.c_str());
+
+  size_t file_size = 0;
+
+  WriteSection(fd, file_size, 0, &header, sizeof(header), tmp_path);
+  WriteSection(fd, file_size, header.text_offset, input0, text_size, tmp_path);
+  WriteSection(fd, file_size, header.suffixes_offset, suffixes_,
+               suffix_count_ * index_size, tmp_path);
+  WriteSection(fd, file_size, header.shared_prefixes_offset, shared_prefixes_,
+               suffix_count_, tmp_path);
+  WriteSection(fd, file_size, header.shared_prefix_overflow_offset,
+               shared_prefix_overflow_,
+               shared_prefix_overflow_count_ * sizeof(*shared_prefix_overflow_),
+               tmp_path);
+  WriteSection(fd, file_size, header.document_starts_offset, document_starts_,
+               document_count_ * sizeof(size_t), tmp_path);
+  WriteSection(fd, file_size, header.n_gram_counts_offset,
+               input0_n_gram_counts_.data(),
+               input0_n_gram_counts_.size() * sizeof(size_t), tmp_path);
+  WriteSection(fd, file_size, file_size, input1_n_gram_counts_.data(),
+               input1_n_gram_counts_.size() * sizeof(size_t), tmp_path);
+
+  if (-1 == close(fd)) err(EX_IOERR, "Write to '%s' failed", tmp_path.c_str());
+
+  if (-1 == rename(tmp_path.c_str(), path))
+    err(EX_CANTCREAT, "Could not rename '%s' to '%s'", tmp_path.c_str(), path);
+}
+
+void CommonSubstringFinder::LoadIndex(const char* path) {
+  int fd;
+  struct stat st;
+
+  if (-1 == (fd = open(path, O_RDONLY)))
+    err(EX_NOINPUT, "Could not open '%s' for reading", path);
+
+  if (-1 == fstat(fd, &st)) err(EX_IOERR, "Could not stat '%s'", path);
+
+  const size_t file_size = st.st_size;
+
+  if (file_size < sizeof(IndexHeader))
+    errx(EX_DATAERR, "'%s' is not an index file", path);
+
+  auto map = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) err(EX_IOERR, "Could not memory-map '%s'", path);
+
+  close(fd);
+
+  const auto base = reinterpret_cast<const char*>(map);
+  const auto& header = *reinterpret_cast<const IndexHeader*>(base);
+
+  if (memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)))
+    errx(EX_DATAERR, "'%s' is not an index file", path);
+
+  if (header.version != kIndexVersion)
+    errx(EX_DATAERR, "'%s' has index version %u, expected %u", path,
+         header.version, kIndexVersion);
+
+  if (!(header.flags & kIndexColor) != !do_color)
+    errx(EX_USAGE, "'%s' was built %s --color", path,
+         do_color ? "without" : "with");
+
+  if (!(header.flags & kIndexWords) != !do_words)
+    errx(EX_USAGE, "'%s' was built %s --words", path,
+         do_words ? "without" : "with");
+
+  if (header.max_suffix_size < max_length)
+    errx(EX_USAGE, "'%s' was built with --max-length=%llu", path,
+         static_cast<unsigned long long>(header.max_suffix_size));
+
+
+  const auto index_size = (header.flags & kIndexWideSuffixes)
+                              ? sizeof(int64_t)
+                              : sizeof(int32_t);
+  const auto n_gram_count =
+      header.input0_n_gram_count + header.input1_n_gram_count;
+
+  if (header.text_offset + header.input0_size + header.input1_size + 1 >
+          file_size ||
+      header.suffixes_offset + header.suffix_count * index_size > file_size ||
+      header.shared_prefixes_offset + header.suffix_count > file_size ||
+      header.shared_prefix_overflow_offset +
+              header.shared_prefix_overflow_count *
+                  sizeof(*shared_prefix_overflow_) >
+          file_size ||
+      header.document_starts_offset + header.document_count * sizeof(size_t) >
+          file_size ||
+      header.n_gram_counts_offset + n_gram_count * sizeof(size_t) > file_size)
+    errx(EX_DATAERR, "'%s' is truncated", path);
+
+  mappings_.emplace_back(map, file_size);
+
+  input0 = base + header.text_offset;
+  input0_size = header.input0_size;
+  input1 = input0 + input0_size + 1;
+  input1_size = header.input1_size;
+
+  wide_suffixes_ = header.flags & kIndexWideSuffixes;
+  suffixes_ = base + header.suffixes_offset;
+  suffix_count_ = header.suffix_count;
+
+  SetSharedPrefixes(
+      reinterpret_cast<const uint8_t*>(base + header.shared_prefixes_offset),
+      reinterpret_cast<const std::pair<uint64_t, uint64_t>*>(
+          base + header.shared_prefix_overflow_offset),
+      header.shared_prefix_overflow_count);
+
+  max_suffix_size_ = max_length;
+  if (header.max_suffix_size > max_suffix_size_) CapSharedPrefixes();
+
+  SetDocumentStarts(
+      reinterpret_cast<const size_t*>(base + header.document_starts_offset),
+      header.document_count);
+  input0_doc_count_ = header.input0_doc_count;
+  input1_doc_count_ = header.input1_doc_count;
+
+  const auto n_gram_counts =
+      reinterpret_cast<const size_t*>(base + header.n_gram_counts_offset);
+  input0_n_gram_counts_.assign(n_gram_counts,
+                               n_gram_counts + header.input0_n_gram_count);
+  input1_n_gram_counts_.assign(n_gram_counts + header.input0_n_gram_count,
+                               n_gram_counts + n_gram_count);
+
+  have_index_ = true;
+}
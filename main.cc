@@ -4,6 +4,7 @@
 
 #include <cassert>
 #include <cctype>
+#include <cerrno>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
@@ -24,27 +25,108 @@ namespace {
 int print_version;
 int print_help;
 
+const char* index_in_path;
+const char* index_out_path;
+const char* append_path;
+
 bool stdout_is_tty;
 
 CommonSubstringFinder csf;
 
 struct option long_options[] = {
+    {"append", required_argument, nullptr, 'a'},
     {"color", no_argument, &csf.do_color, 1},
     {"cover", no_argument, &csf.do_cover, 1},
     {"cover-threshold", required_argument, nullptr, 'c'},
     {"documents", no_argument, &csf.do_document, 1},
+    {"enumeration", required_argument, nullptr, 'E'},
+    {"index-in", required_argument, nullptr, 'i'},
+    {"index-out", required_argument, nullptr, 'o'},
+    {"jaccard", required_argument, nullptr, 'J'},
+    {"maximal", no_argument, &csf.do_maximal, 1},
+    {"max-length", required_argument, nullptr, 'L'},
+    {"memory-limit", required_argument, nullptr, 'm'},
+    {"min-length", required_argument, nullptr, 'l'},
     {"no-equal-sets", no_argument, &csf.allow_equal_sets, 0},
     {"no-filter", no_argument, &csf.filter_redundant_features, 0},
     {"prior-bias", required_argument, nullptr, 'p'},
+    {"sa-engine", required_argument, nullptr, 'e'},
     {"skip-prefixes", no_argument, &csf.skip_samecount_prefixes, 1},
+    {"temp-dir", required_argument, nullptr, 'd'},
+    {"threads", required_argument, nullptr, 'j'},
     {"threshold", required_argument, nullptr, 't'},
     {"threshold-percent", required_argument, nullptr, 'P'},
     {"threshold-count", required_argument, nullptr, 'T'},
+    {"timings", no_argument, &csf.print_timings, 1},
+    {"top-k", required_argument, nullptr, 'k'},
     {"words", no_argument, &csf.do_words, 1},
     {"version", no_argument, &print_version, 1},
     {"help", no_argument, &print_help, 1},
     {0, 0, 0, 0}};
 
+// Parses a byte count with an optional K, M, G or T suffix.  Returns false
+// on parse errors.
+bool ParseSize(const char* string, size_t* result) {
+  char* endptr;
+
+  errno = 0;
+  auto value = strtoull(string, &endptr, 0);
+  if (errno || endptr == string) return false;
+
+  size_t multiplier = 1;
+
+  switch (*endptr) {
+    case 'T': case 't': multiplier <<= 10;  // fall through
+    case 'G': case 'g': multiplier <<= 10;  // fall through
+    case 'M': case 'm': multiplier <<= 10;  // fall through
+    case 'K': case 'k': multiplier <<= 10; ++endptr;
+  }
+
+  if (*endptr) return false;
+
+  *result = value * multiplier;
+
+  return true;
+}
+
+// Parses the name of a suffix array engine.  Returns false if the name is
+// unknown.
+bool ParseEngine(const char* string, SuffixArrayEngine* result) {
+  static const struct {
+    const char* name;
+    SuffixArrayEngine engine;
+  } kEngines[] = {
+      {"auto", SuffixArrayEngine::kAuto},
+      {"divsufsort", SuffixArrayEngine::kDivSufSort},
+      {"sais", SuffixArrayEngine::kInducedSort},
+      {"sparse", SuffixArrayEngine::kSparse},
+      {"bounded", SuffixArrayEngine::kBounded},
+  };
+
+  for (const auto& engine : kEngines) {
+    if (!strcmp(string, engine.name)) {
+      *result = engine.engine;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Parses the name of a substring enumeration engine.  Returns false if the
+// name is unknown.
+bool ParseEnumerationEngine(const char* string, EnumerationEngine* result) {
+  if (!strcmp(string, "scan")) {
+    *result = EnumerationEngine::kScan;
+  } else if (!strcmp(string, "intervals")) {
+    *result = EnumerationEngine::kIntervals;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
 // Memory maps the file specified by path.  Prints an error message and exits
 // on failure.
 void* MapFile(const char* path, size_t* ret_size) {
@@ -69,6 +151,103 @@ void* MapFile(const char* path, size_t* ret_size) {
   return map;
 }
 
+// Reads `size` bytes from the start of the file `fd`, opened from `path`, into
+// `data`.  Prints an error message and exits on failure.
+void ReadFile(int fd, const char* path, char* data, size_t size) {
+  for (size_t offset = 0; offset < size;) {
+    const auto ret = pread(fd, data + offset, size - offset, offset);
+
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+      err(EX_IOERR, "Could not read '%s'", path);
+    }
+
+    if (!ret) errx(EX_IOERR, "Unexpected end of '%s'", path);
+
+    offset += ret;
+  }
+}
+
+// Memory maps the files specified by `path0` and `path1` into one range of
+// memory, separated by a NUL byte, and uses them as the inputs of `csf`.
+// Since CommonSubstringFinder needs the inputs to be adjacent, this saves it
+// from copying them.  Files can only be mapped at page boundaries, so only the
+// larger file is mapped, and the smaller one is read into anonymous memory
+// next to it.  Prints an error message and exits on failure.
+void MapInputs(const char* path0, const char* path1) {
+  const char* paths[2] = {path0, path1};
+  int fds[2];
+  size_t sizes[2];
+
+  for (size_t i = 0; i < 2; ++i) {
+    if (-1 == (fds[i] = open(paths[i], O_RDONLY)))
+      err(EX_NOINPUT, "Could not open '%s' for reading", paths[i]);
+
+    const auto size = lseek(fds[i], 0, SEEK_END);
+    if (size == -1) err(EX_IOERR, "Could not seek to end of '%s'", paths[i]);
+    sizes[i] = size;
+  }
+
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const auto round_up = [page_size](size_t size) {
+    return (size + page_size - 1) / page_size * page_size;
+  };
+
+  // The text starts far enough into the reserved range that the mapped file
+  // starts at a page boundary.
+  const size_t mapped = sizes[1] > sizes[0];
+  const size_t text_offset =
+      mapped ? round_up(sizes[0] + 1) - (sizes[0] + 1) : 0;
+  const auto reserved_size =
+      round_up(text_offset + sizes[0] + 1 + sizes[1]);
+
+  const auto reserved =
+      static_cast<char*>(mmap(nullptr, reserved_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (reserved == MAP_FAILED)
+    err(EX_OSERR, "Could not reserve %zu bytes of memory", reserved_size);
+
+  const auto text = reserved + text_offset;
+  char* data[2] = {text, text + sizes[0] + 1};
+
+  // The mapping is private, so that the part of its last page beyond the end
+  // of the file can hold the start of the other input.
+  if (sizes[mapped]) {
+    auto flags = MAP_PRIVATE | MAP_FIXED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+
+    if (MAP_FAILED ==
+        mmap(data[mapped], sizes[mapped], PROT_READ, flags, fds[mapped], 0))
+      err(EX_IOERR, "Could not memory-map '%s'", paths[mapped]);
+
+#ifndef MAP_POPULATE
+    madvise(data[mapped], sizes[mapped], MADV_WILLNEED);
+#endif
+
+    if (!mapped && sizes[0] % page_size) {
+      if (-1 == mprotect(text + sizes[0] / page_size * page_size, page_size,
+                         PROT_READ | PROT_WRITE))
+        err(EX_OSERR, "mprotect failed");
+    }
+  }
+
+  // The bytes past the end of a file in its last page are zero, so the
+  // delimiter is already in place.
+  ReadFile(fds[!mapped], paths[!mapped], data[!mapped], sizes[!mapped]);
+
+  if (-1 == mprotect(reserved, reserved_size, PROT_READ))
+    err(EX_OSERR, "mprotect failed");
+
+  for (const auto fd : fds) close(fd);
+
+  csf.input0 = data[0];
+  csf.input0_size = sizes[0];
+  csf.input1 = data[1];
+  csf.input1_size = sizes[1];
+}
+
 void PrintString(const ev::StringRef& string) {
   const unsigned char* ch = (const unsigned char*)string.data();
   auto length = string.size();
@@ -153,6 +332,84 @@ int main(int argc, char** argv) {
                "Parse error in cover threshold, expected non-negative integer");
         break;
 
+      case 'i':
+        index_in_path = optarg;
+        break;
+
+      case 'o':
+        index_out_path = optarg;
+        break;
+
+      case 'd':
+        csf.temp_dir = optarg;
+        break;
+
+      case 'l':
+        csf.min_length = strtol(optarg, &endptr, 0);
+
+        if (*endptr || !csf.min_length ||
+            csf.min_length > CommonSubstringFinder::kMaxLength)
+          errx(EX_USAGE,
+               "Parse error in minimum length, expected integer between 1 and "
+               "%zu",
+               CommonSubstringFinder::kMaxLength);
+        break;
+
+      case 'L':
+        csf.max_length = strtol(optarg, &endptr, 0);
+
+        if (*endptr || !csf.max_length ||
+            csf.max_length > CommonSubstringFinder::kMaxLength)
+          errx(EX_USAGE,
+               "Parse error in maximum length, expected integer between 1 and "
+               "%zu",
+               CommonSubstringFinder::kMaxLength);
+        break;
+
+      case 'm':
+        if (!ParseSize(optarg, &csf.memory_limit))
+          errx(EX_USAGE,
+               "Parse error in memory limit, expected byte count with "
+               "optional K, M, G or T suffix");
+        break;
+
+      case 'a':
+        append_path = optarg;
+        break;
+
+      case 'e':
+        if (!ParseEngine(optarg, &csf.sa_engine))
+          errx(EX_USAGE,
+               "Unknown suffix array engine '%s', expected auto, divsufsort, "
+               "sais, sparse or bounded",
+               optarg);
+        break;
+
+      case 'E':
+        if (!ParseEnumerationEngine(optarg, &csf.enumeration_engine))
+          errx(EX_USAGE,
+               "Unknown enumeration engine '%s', expected scan or intervals",
+               optarg);
+        break;
+
+      case 'J':
+        csf.jaccard_threshold = strtod(optarg, &endptr);
+
+        if (*endptr || !(csf.jaccard_threshold > 0) ||
+            csf.jaccard_threshold > 1)
+          errx(EX_USAGE,
+               "Parse error in Jaccard threshold, expected number between 0 "
+               "and 1");
+        break;
+
+      case 'j':
+        csf.threads = strtol(optarg, &endptr, 0);
+
+        if (*endptr || csf.threads < 1)
+          errx(EX_USAGE,
+               "Parse error in thread count, expected positive integer");
+        break;
+
       case 'p':
         csf.prior_bias = strtod(optarg, &endptr);
 
@@ -187,6 +444,13 @@ int main(int argc, char** argv) {
                "Parse error in threshold count, expected non-negative integer");
         break;
 
+      case 'k':
+        csf.top_k = strtol(optarg, &endptr, 0);
+
+        if (*endptr || !csf.top_k)
+          errx(EX_USAGE, "Parse error in top K, expected positive integer");
+        break;
+
       case '?':
         fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
         return EXIT_FAILURE;
@@ -196,6 +460,7 @@ int main(int argc, char** argv) {
   if (print_help) {
     printf(
         "Usage: %s [OPTION]... INPUT1 INPUT2 [INPUT1-MIN [INPUT2-MAX]]\n"
+        "  or:  %s [OPTION]... --index-in=INDEX\n"
         "\n"
         "      --document             count each prefix only once per "
         "document\n"
@@ -214,8 +479,54 @@ int main(int argc, char** argv) {
         "cover\n"
         "                             all input documents.\n"
         "                             Implies --document\n"
+        "      --words                only report whole words and sequences "
+        "of words\n"
+        "      --maximal              only report substrings that can't be "
+        "extended\n"
+        "                             without losing occurrences\n"
+        "      --min-length=N         only report substrings of at least N "
+        "bytes\n"
+        "      --max-length=N         only report substrings of at most N "
+        "bytes\n"
+        "                             (default 32)\n"
+        "      --top-k=K              only keep the K substrings with the "
+        "highest\n"
+        "                             absolute log odds for each input\n"
         "      --no-filter            don't attempt to filter redundant "
         "features\n"
+        "      --no-equal-sets        treat features that occur in the same "
+        "documents\n"
+        "                             as redundant\n"
+        "      --jaccard=J            treat features whose documents have an "
+        "estimated\n"
+        "                             Jaccard similarity of at least J as "
+        "redundant\n"
+        "      --index-out=INDEX      save the suffix array index to INDEX\n"
+        "      --index-in=INDEX       use the suffix array index in INDEX "
+        "instead of\n"
+        "                             reading INPUT1 and INPUT2\n"
+        "      --append=FILE          append the documents in FILE to INPUT2, "
+        "sorting\n"
+        "                             only their suffixes; use with "
+        "--index-in and\n"
+        "                             --index-out to update an index\n"
+        "      --threads=N            use N threads\n"
+        "      --memory-limit=SIZE    build the suffix array in passes over "
+        "temporary\n"
+        "                             files if building it in memory would "
+        "use more\n"
+        "                             than SIZE bytes\n"
+        "      --temp-dir=DIR         store temporary files in DIR\n"
+        "      --sa-engine=ENGINE     build the suffix array with ENGINE: "
+        "auto,\n"
+        "                             divsufsort (default), sais, sparse or "
+        "bounded\n"
+        "      --enumeration=ENGINE   enumerate substrings with ENGINE: "
+        "intervals\n"
+        "                             (default) or scan\n"
+        "      --timings              print the time spent in each phase to "
+        "standard\n"
+        "                             error\n"
         "      --help     display this help and exit\n"
         "      --version  display version information\n"
         "\n"
@@ -228,15 +539,21 @@ int main(int argc, char** argv) {
         "   good starting point.\n"
         "\n"
         "Report bugs to <morten.hustveit@gmail.com>\n",
-        argv[0]);
+        argv[0], argv[0]);
 
     return EXIT_SUCCESS;
   }
 
   if (print_version) errx(EXIT_SUCCESS, "%s", PACKAGE_STRING);
 
-  if (optind + 2 != argc)
-    errx(EX_USAGE, "Usage: %s [OPTION]... INPUT1 INPUT2", argv[0]);
+  if (optind + (index_in_path ? 0 : 2) != argc)
+    errx(EX_USAGE,
+         "Usage: %s [OPTION]... INPUT1 INPUT2\n"
+         "  or:  %s [OPTION]... --index-in=INDEX",
+         argv[0], argv[0]);
+
+  if (csf.min_length > csf.max_length)
+    errx(EX_USAGE, "Minimum length exceeds maximum length");
 
   // --cover implies --unique and --document.
   if (csf.do_cover) {
@@ -245,10 +562,19 @@ int main(int argc, char** argv) {
 
   stdout_is_tty = isatty(STDOUT_FILENO);
 
-  csf.input0 =
-      reinterpret_cast<const char*>(MapFile(argv[optind++], &csf.input0_size));
-  csf.input1 =
-      reinterpret_cast<const char*>(MapFile(argv[optind++], &csf.input1_size));
+  if (index_in_path) {
+    csf.LoadIndex(index_in_path);
+  } else {
+    MapInputs(argv[optind], argv[optind + 1]);
+  }
+
+  if (append_path) {
+    size_t size;
+    const auto data = reinterpret_cast<const char*>(MapFile(append_path, &size));
+    csf.AppendDocuments(data, size);
+  }
+
+  if (index_out_path) csf.SaveIndex(index_out_path);
 
   csf.output = PrintResult;
 
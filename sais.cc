@@ -0,0 +1,142 @@
+#include "sais.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// Sorts the suffixes of `text`, whose symbols are in the range [0, `upper`],
+// into `suffixes`.  The end of the text acts as a virtual sentinel that is
+// smaller than every symbol.
+template <typename Char, typename Index>
+void SAIS(const Char* text, Index* suffixes, Index n, Index upper) {
+  if (n == 0) return;
+
+  if (n == 1) {
+    suffixes[0] = 0;
+    return;
+  }
+
+  // Whether each suffix is S-type, i.e. smaller than the following suffix.
+  std::vector<bool> is_s(n);
+  for (Index i = n - 2; i >= 0; --i)
+    is_s[i] = (text[i] == text[i + 1]) ? is_s[i + 1] : (text[i] < text[i + 1]);
+
+  // Start of the S-type part, and of the whole bucket, for each symbol.
+  std::vector<Index> s_starts(upper + 1), l_starts(upper + 2);
+
+  for (Index i = 0; i < n; ++i) {
+    if (!is_s[i])
+      ++s_starts[text[i]];
+    else
+      ++l_starts[text[i] + 1];
+  }
+
+  for (Index i = 0; i <= upper; ++i) {
+    s_starts[i] += l_starts[i];
+    l_starts[i + 1] += s_starts[i];
+  }
+
+  std::vector<Index> bucket(upper + 2);
+
+  // Places the LMS suffixes in `lms` at the end of their buckets, in the given
+  // order, and induces the order of the remaining suffixes from them.
+  const auto induce = [&](const std::vector<Index>& lms) {
+    std::fill(suffixes, suffixes + n, -1);
+
+    std::copy(s_starts.begin(), s_starts.end(), bucket.begin());
+    for (const auto offset : lms) suffixes[bucket[text[offset]]++] = offset;
+
+    std::copy(l_starts.begin(), l_starts.end() - 1, bucket.begin());
+    suffixes[bucket[text[n - 1]]++] = n - 1;
+
+    for (Index i = 0; i < n; ++i) {
+      const auto offset = suffixes[i];
+      if (offset >= 1 && !is_s[offset - 1])
+        suffixes[bucket[text[offset - 1]]++] = offset - 1;
+    }
+
+    std::copy(l_starts.begin(), l_starts.end(), bucket.begin());
+
+    for (Index i = n - 1; i >= 0; --i) {
+      const auto offset = suffixes[i];
+      if (offset >= 1 && is_s[offset - 1])
+        suffixes[--bucket[text[offset - 1] + 1]] = offset - 1;
+    }
+  };
+
+  // Left-most S-type suffixes, and their index in `lms`.
+  std::vector<Index> lms, lms_index(n, -1);
+
+  for (Index i = 1; i < n; ++i) {
+    if (!is_s[i - 1] && is_s[i]) {
+      lms_index[i] = lms.size();
+      lms.emplace_back(i);
+    }
+  }
+
+  induce(lms);
+
+  if (lms.empty()) return;
+
+  const Index lms_count = lms.size();
+
+  std::vector<Index> sorted_lms;
+  sorted_lms.reserve(lms_count);
+
+  for (Index i = 0; i < n; ++i) {
+    if (lms_index[suffixes[i]] != -1) sorted_lms.emplace_back(suffixes[i]);
+  }
+
+  // Name the LMS substrings by their rank, and sort the string of names
+  // recursively.
+  std::vector<Index> names(lms_count);
+
+  Index name = 0;
+  names[lms_index[sorted_lms[0]]] = 0;
+
+  for (Index i = 1; i < lms_count; ++i) {
+    auto lhs = sorted_lms[i - 1], rhs = sorted_lms[i];
+    const auto lhs_end =
+        (lms_index[lhs] + 1 < lms_count) ? lms[lms_index[lhs] + 1] : n;
+    const auto rhs_end =
+        (lms_index[rhs] + 1 < lms_count) ? lms[lms_index[rhs] + 1] : n;
+
+    bool same = (lhs_end - lhs == rhs_end - rhs);
+
+    if (same) {
+      while (lhs < lhs_end && text[lhs] == text[rhs]) {
+        ++lhs;
+        ++rhs;
+      }
+
+      // The LMS substring ending at the end of the text is unique.
+      if (lhs == n || rhs == n || text[lhs] != text[rhs]) same = false;
+    }
+
+    if (!same) ++name;
+    names[lms_index[sorted_lms[i]]] = name;
+  }
+
+  lms_index.clear();
+  lms_index.shrink_to_fit();
+
+  std::vector<Index> name_suffixes(lms_count);
+  SAIS(names.data(), name_suffixes.data(), lms_count, name);
+
+  for (Index i = 0; i < lms_count; ++i) sorted_lms[i] = lms[name_suffixes[i]];
+
+  induce(sorted_lms);
+}
+
+}  // namespace
+
+void InducedSortSuffixes(const unsigned char* text, int32_t* suffixes,
+                         size_t text_size) {
+  SAIS<unsigned char, int32_t>(text, suffixes, text_size, 255);
+}
+
+void InducedSortSuffixes(const unsigned char* text, int64_t* suffixes,
+                         size_t text_size) {
+  SAIS<unsigned char, int64_t>(text, suffixes, text_size, 255);
+}
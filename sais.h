@@ -0,0 +1,16 @@
+#ifndef SAIS_H_
+#define SAIS_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+
+// Constructs the suffix array of `text` in `suffixes` by induced sorting
+// (SA-IS).  Suffixes are ordered the same way as by divsufsort(): bytes are
+// compared as unsigned values, and a suffix sorts before all longer suffixes
+// it is a prefix of.
+void InducedSortSuffixes(const unsigned char* text, int32_t* suffixes,
+                         size_t text_size);
+void InducedSortSuffixes(const unsigned char* text, int64_t* suffixes,
+                         size_t text_size);
+
+#endif  // !SAIS_H_
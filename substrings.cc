@@ -4,428 +4,2591 @@
 #include <climits>
 #include <cstdlib>
 #include <cstring>
-#include <list>
+#include <limits>
+#include <numeric>
+#include <queue>
 #include <random>
 #include <unordered_set>
 #include <vector>
 
 #include <err.h>
+#include <sys/mman.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "base/string.h"
+#include "libdivsufsort/divsufsort.h"
+#include "libdivsufsort/divsufsort64.h"
+#include "sais.h"
 #include "substrings.h"
 
-namespace {
+namespace {
+
+// Character used to separate documents in document mode.
+static const char kDocumentDelimiter = '\0';
+
+// Counts the number of bits set in an 32 bit integer.
+unsigned int BitCount(uint32_t n) {
+  n = ((0xaaaaaaaa & n) >> 1) + (0x55555555 & n);
+  n = ((0xcccccccc & n) >> 2) + (0x33333333 & n);
+  n = ((0xf0f0f0f0 & n) >> 4) + (0x0f0f0f0f & n);
+  n = ((0xff00ff00 & n) >> 8) + (0x00ff00ff & n);
+  n = ((0xffff0000 & n) >> 16) + (0x0000ffff & n);
+  return n;
+}
+
+unsigned int BitCount(uint64_t n) {
+#ifdef __GNUC__
+  return __builtin_popcountll(n);
+#else
+  return BitCount(static_cast<uint32_t>(n)) +
+         BitCount(static_cast<uint32_t>(n >> 32));
+#endif
+}
+
+// Returns a hash of `value` in which every bit depends on every input bit,
+// using the finalizer of SplitMix64.
+uint64_t MixBits(uint64_t value) {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+// Measures the wall-clock and CPU time spent in one phase of processing, and
+// prints it to standard error when going out of scope.  The ratio of CPU time
+// to wall-clock time is the effective parallel speedup of the phase.
+class PhaseTimer {
+ public:
+  PhaseTimer(const char* name, bool enabled) : name_(name), enabled_(enabled) {
+    if (!enabled_) return;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start_);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start_);
+  }
+
+  ~PhaseTimer() {
+    if (!enabled_) return;
+
+    struct timespec wall_end, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+
+    const auto wall = Seconds(wall_end) - Seconds(wall_start_);
+    const auto cpu = Seconds(cpu_end) - Seconds(cpu_start_);
+
+    fprintf(stderr, "%-24s %9.3f s wall %9.3f s CPU %6.2fx\n", name_, wall,
+            cpu, (wall > 0.0) ? (cpu / wall) : 1.0);
+  }
+
+ private:
+  static double Seconds(const struct timespec& ts) {
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  const char* name_;
+  bool enabled_;
+  struct timespec wall_start_, cpu_start_;
+};
+
+// Sorts the suffixes of `text` using the libdivsufsort build matching the
+// offset type.
+void SortSuffixes(const char* text, int32_t* suffixes, size_t text_size) {
+  if (0 != divsufsort(reinterpret_cast<const sauchar_t*>(text), suffixes,
+                      text_size))
+    errx(EX_SOFTWARE, "divsufsort failed");
+}
+
+void SortSuffixes(const char* text, int64_t* suffixes, size_t text_size) {
+  if (0 != divsufsort64(reinterpret_cast<const sauchar_t*>(text), suffixes,
+                        text_size))
+    errx(EX_SOFTWARE, "divsufsort64 failed");
+}
+
+// Sets the number of threads used by OpenMP, unless `threads` is zero.
+void SetThreadCount(int threads) {
+#ifdef _OPENMP
+  if (threads > 0) omp_set_num_threads(threads);
+#endif
+}
+
+// Returns true if `ch` separates words in --words mode.  Besides whitespace,
+// this includes the document delimiter and other control characters, so that
+// separators sort before all word characters.
+bool IsWordSeparator(unsigned char ch) { return ch <= ' '; }
+
+// Left context of a set of suffixes whose left contexts differ, or that
+// includes a suffix with nothing before it.
+const uint32_t kMixedLeftContext = 0;
+
+uint32_t MergeLeftContexts(uint32_t lhs, uint32_t rhs) {
+  return (lhs == rhs) ? lhs : kMixedLeftContext;
+}
+
+// Multiplier of the polynomial hash used by StringHash().
+const uint64_t kStringHashBase = 0x100000001b3ULL;
+
+// Returns a polynomial hash of `string`, modulo 2^64.
+uint64_t StringHash(const ev::StringRef& string) {
+  uint64_t result = 0;
+  for (const auto ch : string)
+    result = result * kStringHashBase + static_cast<unsigned char>(ch);
+  return result;
+}
+
+// Returns the hash of `band` of `min_hashes` for
+// CommonSubstringFinder::FeatureIndex::bands.
+uint64_t BandHash(const std::vector<uint32_t>& min_hashes, size_t band,
+                  size_t rows) {
+  uint64_t result = band;
+  for (size_t i = band * rows; i < (band + 1) * rows; ++i)
+    result = result * kStringHashBase + min_hashes[i];
+  return result;
+}
+
+// Returns the Jaccard similarity of two document sets estimated from their
+// MinHash signatures: the fraction of non-empty bins with equal minimums.
+double EstimateJaccard(const std::vector<uint32_t>& lhs,
+                       const std::vector<uint32_t>& rhs) {
+  size_t equal = 0, total = 0;
+
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (lhs[i] == UINT32_MAX && rhs[i] == UINT32_MAX) continue;
+    ++total;
+    if (lhs[i] == rhs[i]) ++equal;
+  }
+
+  return total ? static_cast<double>(equal) / total : 1.0;
+}
+
+// Returns the number of threads OpenMP may use in a parallel region.
+int MaxThreadCount() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// Returns the index of the calling thread in the current parallel region.
+int ThreadIndex() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Number of iterations ahead to prefetch random memory accesses.
+const size_t kPrefetchDistance = 16;
+
+// Hints to the processor that `address` will be read soon.
+inline void Prefetch(const void* address) {
+#ifdef __GNUC__
+  __builtin_prefetch(address);
+#endif
+}
+
+// Returns true if any byte in `v` is zero.
+bool HasZeroByte(uint64_t v) {
+  return (v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL;
+}
+
+// Returns the length of the prefix shared by the suffixes at offsets `a` and
+// `b`, stopping at `limit`, and at the first document delimiter.
+size_t CommonPrefixLength(const char* text, size_t text_size, size_t a,
+                          size_t b, size_t limit) {
+  static_assert(kDocumentDelimiter == 0,
+                "HasZeroByte() is used to find document delimiters");
+
+  limit = std::min(limit, text_size - std::max(a, b));
+
+  size_t result = 0;
+
+  // Skip 16 bytes at a time, as long as they match and contain no delimiter.
+  for (; result + 16 <= limit; result += 16) {
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, text + a + result, 8);
+    memcpy(&a1, text + a + result + 8, 8);
+    memcpy(&b0, text + b + result, 8);
+    memcpy(&b1, text + b + result + 8, 8);
+
+    if ((a0 ^ b0) || (a1 ^ b1) || HasZeroByte(a0) || HasZeroByte(a1)) break;
+  }
+
+  while (result < limit && text[a + result] != kDocumentDelimiter &&
+         text[a + result] == text[b + result])
+    ++result;
+
+  return result;
+}
+
+// Returns up to 8 bytes of the suffix at `offset`, starting at `depth`, packed
+// in big-endian order so that keys compare like the strings they came from.
+// Bytes at or after the first document delimiter, the end of the text, or
+// `max_depth` are zero.
+uint64_t PackedPrefix(const unsigned char* text, size_t text_size,
+                      size_t offset, size_t depth, size_t max_depth) {
+  uint64_t result = 0;
+  size_t i;
+
+  for (i = 0; i < 8 && depth + i < max_depth && offset + depth + i < text_size;
+       ++i) {
+    const auto ch = text[offset + depth + i];
+    if (ch == static_cast<unsigned char>(kDocumentDelimiter)) break;
+    result = (result << 8) | ch;
+  }
+
+  return i ? result << (64 - 8 * i) : 0;
+}
+
+// Sorts `keys` by their first member.  This is a stable least significant digit
+// radix sort, which skips the bytes that are equal in all keys.
+template <typename Index>
+void RadixSortKeys(std::vector<std::pair<uint64_t, Index>>& keys) {
+  if (keys.size() < 64) {
+    std::stable_sort(keys.begin(), keys.end(),
+                     [](const std::pair<uint64_t, Index>& lhs,
+                        const std::pair<uint64_t, Index>& rhs) {
+                       return lhs.first < rhs.first;
+                     });
+    return;
+  }
+
+  size_t counts[8][256];
+  memset(counts, 0, sizeof(counts));
+
+  for (const auto& key : keys) {
+    for (size_t byte = 0; byte < 8; ++byte)
+      ++counts[byte][(key.first >> (byte * 8)) & 0xff];
+  }
+
+  std::vector<std::pair<uint64_t, Index>> buffer(keys.size());
+
+  for (size_t byte = 0; byte < 8; ++byte) {
+    const auto shift = byte * 8;
+
+    if (counts[byte][(keys[0].first >> shift) & 0xff] == keys.size()) continue;
+
+    size_t offset = 0;
+    for (auto& count : counts[byte]) {
+      const auto next = offset + count;
+      count = offset;
+      offset = next;
+    }
+
+    for (const auto& key : keys)
+      buffer[counts[byte][(key.first >> shift) & 0xff]++] = key;
+
+    keys.swap(buffer);
+  }
+}
+
+// Sorts suffixes known to share their first `depth` bytes by their first
+// `max_depth` bytes, treating document delimiters as the end of the suffix.
+// Suffixes must be given in offset order, and suffixes that are still equal
+// stay in that order.
+template <typename Index>
+void SortSuffixesToDepth(const unsigned char* text, size_t text_size,
+                         Index* suffixes, size_t count, size_t depth,
+                         size_t max_depth) {
+  std::vector<std::pair<uint64_t, Index>> keys;
+  keys.reserve(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    keys.emplace_back(
+        PackedPrefix(text, text_size, suffixes[i], depth, max_depth),
+        suffixes[i]);
+  }
+
+  RadixSortKeys(keys);
+
+  for (size_t i = 0; i < count; ++i) suffixes[i] = keys[i].second;
+
+  if (depth + 8 >= max_depth) return;
+
+  // Runs of equal keys that weren't cut short by a delimiter need to be
+  // ordered by their next 8 bytes.
+  std::vector<std::pair<size_t, size_t>> runs;
+
+  for (size_t i = 0, j; i < count; i = j) {
+    for (j = i + 1; j < count && keys[j].first == keys[i].first; ++j) {
+    }
+
+    if (j - i > 1 && (keys[i].first & 0xff)) runs.emplace_back(i, j);
+  }
+
+  keys.clear();
+  keys.shrink_to_fit();
+
+  for (const auto& run : runs) {
+    SortSuffixesToDepth(text, text_size, suffixes + run.first,
+                        run.second - run.first, depth + 8, max_depth);
+  }
+}
+
+template <typename T>
+void WriteArray(FILE* file, const std::string& path, const T* data,
+                size_t count) {
+  if (count != fwrite(data, sizeof(T), count, file))
+    err(EX_IOERR, "Write to '%s' failed", path.c_str());
+}
+
+}  // namespace
+
+CommonSubstringFinder::~CommonSubstringFinder() {
+  for (const auto& mapping : mappings_) munmap(mapping.first, mapping.second);
+}
+
+template <typename Index>
+void CommonSubstringFinder::BuildLCPArray(const Index* suffixes,
+                                          size_t suffix_count) {
+  const auto text = input0;
+  const auto text_size = input0_size + input1_size + 1;
+  const auto max_shared_prefix = max_suffix_size_ + 1;
+
+  shared_prefixes_storage_.resize(suffix_count);
+  shared_prefix_overflow_storage_.clear();
+
+  if (!suffix_count) return;
+
+  // Each segment needs one byte per byte of text.
+  const auto segment_size =
+      std::max(text_size / sizeof(Index), static_cast<size_t>(1 << 20));
+
+  // Segments are further split into chunks processed in parallel.
+  static const size_t kChunkSize = 1 << 16;
+
+  // For each offset in the segment, the offset of the following suffix in the
+  // suffix array, which is then replaced by the length of the prefix shared
+  // with it.  -1 for offsets that are not in the suffix array.
+  std::vector<Index> permuted;
+
+  for (size_t begin = 0; begin < text_size; begin += segment_size) {
+    const auto end = std::min(begin + segment_size, text_size);
+
+    permuted.assign(end - begin, -1);
+
+    const auto in_segment = [begin, end](size_t offset) {
+      return offset >= begin && offset < end;
+    };
+
+#pragma omp parallel for
+    for (size_t i = 1; i < suffix_count; ++i) {
+      const size_t offset = suffixes[i - 1];
+      if (in_segment(offset)) permuted[offset - begin] = suffixes[i];
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t chunk_begin = begin; chunk_begin < end;
+         chunk_begin += kChunkSize) {
+      const auto chunk_end = std::min(chunk_begin + kChunkSize, end);
+
+      // The shared prefix of the suffix at offset X is at least as long as
+      // the one at offset X - 1, minus 1.
+      size_t h = 0;
+
+      for (size_t offset = chunk_begin; offset < chunk_end; ++offset) {
+        if (offset + kPrefetchDistance < chunk_end &&
+            permuted[offset + kPrefetchDistance - begin] != -1)
+          Prefetch(text + permuted[offset + kPrefetchDistance - begin]);
+
+        auto& entry = permuted[offset - begin];
+
+        if (entry == -1) {
+          if (h > 0) --h;
+          continue;
+        }
+
+        h += CommonPrefixLength(text, text_size, offset + h, entry + h,
+                                max_shared_prefix - h);
+        entry = h;
+
+        if (h > 0) --h;
+      }
+    }
+
+#pragma omp parallel for
+    for (size_t i = 1; i < suffix_count; ++i) {
+      const size_t offset = suffixes[i - 1];
+      if (in_segment(offset))
+        StoreSharedPrefix(i - 1, permuted[offset - begin]);
+    }
+  }
+
+  StoreSharedPrefix(suffix_count - 1, 0);
+}
+
+template <typename Index>
+void CommonSubstringFinder::FindSubstrings(const Index* suffixes) {
+  size_t input0_threshold, input1_threshold;
+
+  if (do_document && threshold_count == -1) {
+    input0_threshold = input0_doc_count_ * threshold_percent / 100;
+    input1_threshold = input1_doc_count_ * threshold_percent / 100;
+  } else {
+    input0_threshold = threshold_count;
+    input1_threshold = threshold_count;
+  }
+
+  PhaseTimer timer("Substring enumeration", print_timings);
+
+  BuildInput0Ranks(suffixes);
+
+  if (do_document) {
+    BuildSuffixDocuments(suffixes);
+    BuildDocumentHashKeys();
+  }
+
+  if (do_maximal) BuildLeftContexts(suffixes);
+
+  std::vector<ThreadState> states(MaxThreadCount());
+
+  // Each suffix array entry only reads the arrays, so the entries are split
+  // into chunks that are processed in parallel.  The candidates of each chunk
+  // are then added in chunk order, which gives the same features as a serial
+  // pass.  Chunks are processed in batches to bound the memory used by
+  // candidates when there is no threshold.
+  static const size_t kChunkSize = 1 << 14;
+  static const size_t kChunksPerBatch = 256;
+
+  const auto chunk_count = (suffix_count_ + kChunkSize - 1) / kChunkSize;
+
+  BuildPriorOdds();
+
+  ChunkSummaries chunks, blocks;
+  chunks.starts.resize(chunk_count + 1);
+  chunks.starts[0] = 1;
+  chunks.starts[chunk_count] = suffix_count_;
+
+#pragma omp parallel for
+  for (size_t chunk = 1; chunk < chunk_count; ++chunk)
+    chunks.starts[chunk] = ChunkStart(chunk * kChunkSize, kChunkSize);
+
+  if (enumeration_engine == EnumerationEngine::kIntervals) {
+    // Distinct documents are counted from the links between entries from
+    // the same document.  Equal and similar document sets are detected by
+    // hashing the sets, which still needs the bitsets in AddSuffix().
+    const auto count_documents =
+        do_document && allow_equal_sets && !(jaccard_threshold > 0);
+
+    if (count_documents) BuildDocumentSharedPrefixes(suffixes);
+
+    // Intervals whose substrings can't pass the thresholds are skipped a
+    // block at a time.  Unless `top_k` raises the bounds as candidates are
+    // found, an interval spanning a whole block can only fail if one with
+    // half as many entries, all from one input, does.  The duplicates of
+    // blocks aren't summarized, since that would take too much memory.
+    const ThreadState initial_state;
+
+    if (top_k ||
+        !MayPassThresholds(kBlockSize / 2, 0, 1, input0_threshold,
+                           input1_threshold, initial_state) ||
+        !MayPassThresholds(0, kBlockSize / 2, 1, input0_threshold,
+                           input1_threshold, initial_state)) {
+      const auto block_count = (suffix_count_ + kBlockSize - 1) / kBlockSize;
+
+      blocks.starts.resize(block_count + 1);
+      for (size_t block = 0; block < block_count; ++block)
+        blocks.starts[block] = block * kBlockSize + 1;
+      blocks.starts[block_count] = suffix_count_;
+
+      SummarizeChunks(suffixes, false, nullptr, blocks);
+    }
+
+    SummarizeChunks(suffixes, count_documents,
+                    blocks.starts.empty() ? nullptr : &blocks, chunks);
+  }
+
+  std::vector<std::vector<Candidate>> candidates(
+      std::min(chunk_count, kChunksPerBatch));
+
+  for (size_t batch = 0; batch < chunk_count; batch += kChunksPerBatch) {
+    const auto batch_end = std::min(batch + kChunksPerBatch, chunk_count);
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t chunk = batch; chunk < batch_end; ++chunk) {
+      auto& state = states[ThreadIndex()];
+
+      if (enumeration_engine == EnumerationEngine::kIntervals) {
+        FindIntervalsInChunk(suffixes, chunks, blocks, chunk,
+                             input0_threshold, input1_threshold, state,
+                             candidates[chunk - batch]);
+      } else {
+        FindSubstringsInRange(suffixes, chunks.starts[chunk],
+                              chunks.starts[chunk + 1], input0_threshold,
+                              input1_threshold, state,
+                              candidates[chunk - batch]);
+      }
+
+      // The best candidates can only be added as features once all chunks
+      // are done.
+      if (top_k) AddTopCandidates(chunk, candidates[chunk - batch], state);
+    }
+
+    for (size_t chunk = batch; chunk < batch_end; ++chunk) {
+      for (const auto& candidate : candidates[chunk - batch])
+        AddFeature(candidate);
+      candidates[chunk - batch].clear();
+    }
+  }
+
+  if (top_k) AddTopFeatures(states);
+
+  if (filter_redundant_features && jaccard_threshold > 0)
+    RemoveSimilarFeatures();
+
+  document_shared_prefixes_.clear();
+  document_shared_prefixes_.shrink_to_fit();
+  suffix_documents_.clear();
+  suffix_documents_.shrink_to_fit();
+  left_contexts_.clear();
+  left_contexts_.shrink_to_fit();
+
+  for (auto& feature_index : feature_indexes_) feature_index = FeatureIndex();
+}
+
+template <typename Index>
+void CommonSubstringFinder::SummarizeChunks(const Index* suffixes,
+                                            bool count_documents,
+                                            const ChunkSummaries* blocks,
+                                            ChunkSummaries& chunks) const {
+  const auto chunk_count = chunks.starts.size() - 1;
+  const auto depth_count = max_suffix_size_ + 2;
+
+  chunks.min_prefixes.resize(chunk_count);
+  chunks.min_offsets.resize(chunk_count);
+  if (count_documents)
+    chunks.duplicate_counts.resize(chunk_count * 2 * depth_count);
+  if (do_maximal) chunks.left_contexts.resize(chunk_count);
+
+  // Without duplicates to count, whole blocks are summarized from `blocks`.
+  if (count_documents) blocks = nullptr;
+
+#pragma omp parallel for
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+    const auto begin = chunks.starts[chunk] - 1;
+    const auto end = (chunk + 1 < chunk_count) ? chunks.starts[chunk + 1] - 1
+                                               : suffix_count_;
+    size_t min_prefix = max_suffix_size_ + 1;
+    size_t min_offset = suffixes[begin];
+    auto left_context = do_maximal ? left_contexts_[begin] : kMixedLeftContext;
+
+    for (auto i = begin; i < end;) {
+      if (blocks && i % kBlockSize == 0 && i + kBlockSize <= end) {
+        const auto block = i / kBlockSize;
+        min_prefix = std::min<size_t>(min_prefix, blocks->min_prefixes[block]);
+        min_offset = std::min(min_offset, blocks->min_offsets[block]);
+        if (do_maximal) {
+          left_context =
+              MergeLeftContexts(left_context, blocks->left_contexts[block]);
+        }
+
+        i += kBlockSize;
+        continue;
+      }
+
+      min_prefix = std::min(min_prefix, SharedPrefix(i));
+      min_offset = std::min<size_t>(min_offset, suffixes[i]);
+      if (do_maximal)
+        left_context = MergeLeftContexts(left_context, left_contexts_[i]);
+
+      if (count_documents) {
+        const auto input = static_cast<size_t>(suffixes[i]) >= input0_size;
+        ++chunks.duplicate_counts[(chunk * 2 + input) * depth_count +
+                                  document_shared_prefixes_[i]];
+      }
+
+      ++i;
+    }
+
+    chunks.min_prefixes[chunk] = min_prefix;
+    chunks.min_offsets[chunk] = min_offset;
+    if (do_maximal) chunks.left_contexts[chunk] = left_context;
+  }
+}
+
+void CommonSubstringFinder::BuildPriorOdds() {
+  const auto depth_count = max_suffix_size_ + 2;
+
+  min_prior_odds_.resize(depth_count);
+  max_prior_odds_.resize(depth_count);
+
+  for (size_t length = depth_count; length--;) {
+    // Same as in AddSuffix().
+    double input0_denominator = 0.0, input1_denominator = 0.0;
+
+    if (do_document) {
+      input0_denominator = input0_doc_count_;
+      input1_denominator = input1_doc_count_;
+    } else if (do_probability || threshold) {
+      if (length < input0_n_gram_counts_.size())
+        input0_denominator = input0_n_gram_counts_[length];
+
+      if (length < input1_n_gram_counts_.size())
+        input1_denominator = input1_n_gram_counts_[length];
+    }
+
+    const auto prior_odds =
+        (input0_denominator + prior_bias) / (input1_denominator + prior_bias);
+
+    min_prior_odds_[length] = max_prior_odds_[length] = prior_odds;
+
+    if (length + 1 < depth_count) {
+      min_prior_odds_[length] =
+          std::min(min_prior_odds_[length], min_prior_odds_[length + 1]);
+      max_prior_odds_[length] =
+          std::max(max_prior_odds_[length], max_prior_odds_[length + 1]);
+    }
+  }
+}
+
+bool CommonSubstringFinder::MayPassThresholds(size_t input0_count,
+                                              size_t input1_count,
+                                              size_t length,
+                                              size_t input0_threshold,
+                                              size_t input1_threshold,
+                                              const ThreadState& state) const {
+  // Log odds may be NaN without a prior bias, which passes any threshold.
+  if (!(prior_bias > 0)) return true;
+
+  const auto input0_passes = input0_count >= input0_threshold;
+  const auto input1_passes = input1_count >= input1_threshold;
+
+  if (!input0_passes && !input1_passes) return false;
+
+  length = std::min(length, max_suffix_size_ + 1);
+
+  // Computed the same way as in AddSuffix(), so that rounding can't make
+  // the bounds stricter than the thresholds.
+  const auto get_log_odds = [this](size_t input0_hits, size_t input1_hits,
+                                   double prior_odds) {
+    const auto A_given_K_odds =
+        (input0_hits + prior_bias) / (input1_hits + prior_bias);
+    return std::log(A_given_K_odds / prior_odds);
+  };
+
+  // The most extreme log odds in favor of either input, with as few hits in
+  // the other input as the count thresholds allow.
+  const auto max_log_odds =
+      get_log_odds(input0_count, input0_passes ? 0 : input1_threshold,
+                   min_prior_odds_[length]);
+  const auto min_log_odds =
+      get_log_odds(input1_passes ? 0 : input0_threshold, input1_count,
+                   max_prior_odds_[length]);
+
+  return (max_log_odds > 0 &&
+          max_log_odds >= std::max(threshold, state.min_log_odds[0])) ||
+         (min_log_odds <= 0 &&
+          -min_log_odds >= std::max(threshold, state.min_log_odds[1]));
+}
+
+template <typename Index>
+void CommonSubstringFinder::BuildInput0Ranks(const Index* suffixes) {
+  // One extra block, so that Input0Rank(suffix_count_) is valid.
+  input0_ranks_.resize(suffix_count_ / 64 + 1);
+
+#pragma omp parallel for
+  for (size_t block = 0; block < input0_ranks_.size(); ++block) {
+    const auto end = std::min(block * 64 + 64, suffix_count_);
+    uint64_t bits = 0;
+
+    for (auto i = block * 64; i < end; ++i) {
+      if (static_cast<size_t>(suffixes[i]) < input0_size)
+        bits |= uint64_t(1) << (i & 63);
+    }
+
+    input0_ranks_[block].bits = bits;
+  }
+
+  size_t rank = 0;
+
+  for (auto& block : input0_ranks_) {
+    block.rank = rank;
+    rank += BitCount(block.bits);
+  }
+}
+
+void CommonSubstringFinder::BuildDocumentHashKeys() {
+  std::minstd_rand rng(123);
+  std::uniform_int_distribution<uint64_t> dist;
+
+  document_hash_keys_.resize((document_count_ + 31) / 32);
+  document_hash_base_ = 0;
+
+  for (auto& key : document_hash_keys_) {
+    key = dist(rng);
+    document_hash_base_ += key;
+  }
+}
+
+template <typename Index>
+void CommonSubstringFinder::BuildSuffixDocuments(const Index* suffixes) {
+  if (document_count_ > std::numeric_limits<uint32_t>::max() ||
+      (memory_limit && suffix_count_ * sizeof(uint32_t) > memory_limit))
+    return;
+
+  suffix_documents_.resize(suffix_count_);
+
+#pragma omp parallel for
+  for (size_t i = 0; i < suffix_count_; ++i)
+    suffix_documents_[i] = DocIdxForOffset(suffixes[i]);
+}
+
+template <typename Index>
+void CommonSubstringFinder::BuildDocumentSharedPrefixes(const Index* suffixes) {
+  document_shared_prefixes_.resize(suffix_count_);
+
+  // Last entry seen from each document.
+  std::vector<Index> last_entries(document_count_, -1);
+
+  // Entries whose shared prefix with the next entry is shorter than that of
+  // all later entries seen so far, so that the smallest shared prefix in any
+  // range ending at the current entry is found by binary search.
+  std::vector<std::pair<size_t, size_t>> minima;
+
+  for (size_t i = 0; i < suffix_count_; ++i) {
+    auto& last_entry = last_entries[SuffixDocument(i, suffixes[i])];
+
+    if (last_entry == -1) {
+      document_shared_prefixes_[i] = 0;
+    } else {
+      const auto minimum = std::lower_bound(
+          minima.begin(), minima.end(), static_cast<size_t>(last_entry),
+          [](const auto& lhs, size_t rhs) { return lhs.first < rhs; });
+      document_shared_prefixes_[i] = minimum->second;
+    }
+
+    last_entry = i;
+
+    const auto shared_prefix = SharedPrefix(i);
+    while (!minima.empty() && minima.back().second >= shared_prefix)
+      minima.pop_back();
+    minima.emplace_back(i, shared_prefix);
+  }
+}
+
+size_t CommonSubstringFinder::Input0Rank(size_t index) const {
+  const auto& block = input0_ranks_[index >> 6];
+  return block.rank +
+         BitCount(block.bits & ((uint64_t(1) << (index & 63)) - 1));
+}
+
+size_t CommonSubstringFinder::ChunkStart(size_t index,
+                                         size_t max_distance) const {
+  if (index >= suffix_count_) return suffix_count_;
+
+  const auto end = std::min(index + max_distance, suffix_count_);
+  auto result = index;
+
+  for (auto i = index + 1; i < end && SharedPrefix(result - 1); ++i) {
+    if (SharedPrefix(i - 1) < SharedPrefix(result - 1)) result = i;
+  }
+
+  return result;
+}
+
+template <typename Index>
+void CommonSubstringFinder::FindSubstringsInRange(
+    const Index* suffixes, size_t begin, size_t end, size_t input0_threshold,
+    size_t input1_threshold, ThreadState& state,
+    std::vector<Candidate>& candidates) const {
+  for (size_t i = begin; i < end; ++i) {
+    const auto previous_prefix_length = (i > 1) ? SharedPrefix(i - 2) : 0;
+    const auto prefix_length = SharedPrefix(i - 1);
+
+    // Skip shared prefixes that are duplicates, or shorter versions of
+    // previous previous ones.
+    if (prefix_length <= previous_prefix_length) continue;
+
+    if (prefix_length < min_length) continue;
+
+    // Index of the first suffix matching the current prefix.
+    const auto first_match = i - 1;
+
+    auto first_occurence = std::min(suffixes[i - 1], suffixes[i]);
+
+    size_t j = i + 1;
+    size_t count = 2;
+
+    // Collect counts for all prefixes of the current prefix.  Shorter prefixes
+    // are guaranteed to have higher counts than longer prefixes.
+    for (size_t prefix_prefix_length = prefix_length;
+         j <= suffix_count_ &&
+             prefix_prefix_length > previous_prefix_length &&
+             prefix_prefix_length >= min_length;) {
+      // Avoid prefixes that terminate inside a UTF-8 character.
+      if (first_occurence + prefix_prefix_length < input0_size && (input0[first_occurence + prefix_prefix_length] & 0xc0) == 0x80) {
+        --prefix_prefix_length;
+        continue;
+      }
+
+      if (SharedPrefix(j - 1) < prefix_prefix_length) {
+        AddSuffix(ev::StringRef(input0 + first_occurence, prefix_prefix_length),
+                  suffixes, first_match, count, nullptr, nullptr,
+                  input0_threshold, input1_threshold, state, candidates);
+
+        if (!skip_samecount_prefixes) {
+          --prefix_prefix_length;
+        } else {
+          prefix_prefix_length = SharedPrefix(j - 1);
+        }
+
+        // Skip odd lengths when we're doing coloring.
+        if (do_color) prefix_prefix_length &= ~1ULL;
+
+        continue;
+      }
+
+      if (suffixes[j] < first_occurence) first_occurence = suffixes[j];
+
+      ++count;
+      ++j;
+    }
+  }
+}
+
+template <typename Index>
+void CommonSubstringFinder::FindIntervalsInChunk(
+    const Index* suffixes, const ChunkSummaries& chunks,
+    const ChunkSummaries& blocks, size_t chunk, size_t input0_threshold,
+    size_t input1_threshold, ThreadState& state,
+    std::vector<Candidate>& candidates) const {
+  const auto& chunk_starts = chunks.starts;
+  const auto chunk_count = chunks.min_prefixes.size();
+  const auto count_documents = !chunks.duplicate_counts.empty();
+  const auto skip_intervals = !blocks.min_prefixes.empty();
+  const auto depth_count = max_suffix_size_ + 2;
+
+  // Range of suffix array entries in each chunk.  The LCP intervals reported
+  // here are those whose left boundary is in this chunk.
+  const auto chunk_begin = [&chunk_starts](size_t chunk) {
+    return chunk_starts[chunk] - 1;
+  };
+  const auto chunk_end = [this, &chunk_starts, chunk_count](size_t chunk) {
+    return (chunk + 1 < chunk_count) ? chunk_starts[chunk + 1] - 1
+                                     : suffix_count_;
+  };
+
+  const auto last_left = chunk_end(chunk);
+
+  struct Interval {
+    size_t shared_prefix;
+    size_t left;
+    size_t first_occurence;
+
+    // Next prefix length to report for substrings starting at `left`.  This
+    // carries over from an interval to the enclosing one with the same left
+    // boundary, the way the prefix length does in FindSubstringsInRange().
+    size_t length;
+
+    // In document mode, the number of entries in input0 and input1 whose
+    // previous entry from the same document is also in this interval.
+    // Subtracted from the entry counts, these give the document counts.
+    size_t duplicates[2];
+
+    // With `do_maximal`, the left context shared by the entries.
+    uint32_t left_context;
+
+    // When skipping intervals, the last entry, once it has been found.
+    size_t right;
+  };
+
+  // Open intervals, innermost last.  The bottom entry is a sentinel that is
+  // never closed before the end of the loop.
+  std::vector<Interval> stack;
+  stack.push_back(Interval{0, chunk_begin(chunk),
+                           std::numeric_limits<size_t>::max(), 0, {0, 0},
+                           kMixedLeftContext, 0});
+
+  // Adds `count` duplicates from `input` to the innermost open interval that
+  // contains the previous entry from the same document, i.e. whose shared
+  // prefix is at most `document_shared_prefix`.  The counts are passed on to
+  // the enclosing intervals as they are closed.
+  const auto add_duplicates = [&stack](size_t document_shared_prefix,
+                                       size_t input, size_t count) {
+    auto interval = stack.end() - 1;
+    while (interval->shared_prefix > document_shared_prefix) --interval;
+    interval->duplicates[input] += count;
+  };
+
+  // Left boundary of each candidate, for ordering them the way the scan
+  // engine does: by left boundary, then by decreasing length.
+  std::vector<size_t> candidate_lefts;
+  const auto first_candidate = candidates.size();
+
+  // Reports the substrings of `interval`, whose last entry is `right`, and
+  // returns the next prefix length for the enclosing interval.
+  const auto report = [&](const Interval& interval, size_t right) {
+    const auto left = interval.left;
+
+    const auto enclosing_length =
+        std::max(left ? SharedPrefix(left - 1) : 0, SharedPrefix(right));
+    const auto first_occurence = interval.first_occurence;
+    auto length = interval.length;
+
+    const auto count = right - left + 1;
+    size_t hits[2] = {0, 0}, document_hits[2];
+
+    if (count_documents || skip_intervals) {
+      hits[0] = Input0Rank(right + 1) - Input0Rank(left);
+      hits[1] = count - hits[0];
+    }
+
+    if (count_documents) {
+      document_hits[0] = hits[0] - interval.duplicates[0];
+      document_hits[1] = hits[1] - interval.duplicates[1];
+    }
+
+    // The lengths are still counted down for the enclosing interval when
+    // none of the substrings can pass the thresholds.
+    const auto skip =
+        skip_intervals &&
+        !MayPassThresholds(
+            count_documents ? document_hits[0] : hits[0],
+            count_documents ? document_hits[1] : hits[1],
+            enclosing_length + 1, input0_threshold, input1_threshold, state);
+
+    // Lengths below `min_length` are only carried over to the enclosing
+    // interval, which can't report them either.
+    while (length > enclosing_length && length >= min_length) {
+      // Avoid prefixes that terminate inside a UTF-8 character.
+      if (first_occurence + length < input0_size &&
+          (input0[first_occurence + length] & 0xc0) == 0x80) {
+        --length;
+        continue;
+      }
+
+      if (!skip) {
+        AddSuffix(ev::StringRef(input0 + first_occurence, length), suffixes,
+                  left, count, count_documents ? document_hits : nullptr,
+                  &interval.left_context, input0_threshold, input1_threshold,
+                  state, candidates);
+        candidate_lefts.resize(candidates.size() - first_candidate, left);
+      }
+
+      if (!skip_samecount_prefixes) {
+        --length;
+      } else {
+        length = SharedPrefix(right);
+      }
+
+      // Skip odd lengths when we're doing coloring.
+      if (do_color) length &= ~1ULL;
+    }
+
+    return length;
+  };
+
+  // Adds entry `i` to the open intervals, and closes those that end at `i`.
+  // Intervals that start after this chunk are not opened.
+  const auto visit = [&](size_t i) {
+    const size_t offset = suffixes[i];
+    const auto shared_prefix = SharedPrefix(i);
+
+    const auto left_context =
+        do_maximal ? left_contexts_[i] : kMixedLeftContext;
+
+    auto& innermost = stack.back();
+    innermost.first_occurence = std::min(innermost.first_occurence, offset);
+    innermost.left_context =
+        MergeLeftContexts(innermost.left_context, left_context);
+
+    if (count_documents && document_shared_prefixes_[i])
+      add_duplicates(document_shared_prefixes_[i], offset >= input0_size, 1);
+
+    Interval next{shared_prefix, i, offset, shared_prefix, {0, 0},
+                  left_context, 0};
+
+    while (stack.back().shared_prefix > shared_prefix) {
+      const auto closed = stack.back();
+      stack.pop_back();
+
+      next.left = closed.left;
+      next.first_occurence = closed.first_occurence;
+      next.left_context = closed.left_context;
+      next.length = report(closed, i);
+
+      auto& parent = stack.back();
+      parent.first_occurence =
+          std::min(parent.first_occurence, closed.first_occurence);
+      parent.left_context =
+          MergeLeftContexts(parent.left_context, closed.left_context);
+
+      // The closed interval is a child of `next` if that is opened, and of
+      // `parent` otherwise.
+      auto& duplicates = (parent.shared_prefix >= shared_prefix)
+                             ? parent.duplicates
+                             : next.duplicates;
+      duplicates[0] += closed.duplicates[0];
+      duplicates[1] += closed.duplicates[1];
+    }
+
+    if (stack.back().shared_prefix < shared_prefix && next.left < last_left)
+      stack.push_back(next);
+  };
+
+  // Adds the entries of chunk or block `index` in `summaries` to the
+  // innermost open interval, which contains all of them.  Block summaries
+  // don't include the duplicates.
+  const auto absorb_summary = [&](const ChunkSummaries& summaries,
+                                  size_t index) {
+    auto& innermost = stack.back();
+    innermost.first_occurence =
+        std::min(innermost.first_occurence, summaries.min_offsets[index]);
+    if (do_maximal) {
+      innermost.left_context = MergeLeftContexts(
+          innermost.left_context, summaries.left_contexts[index]);
+    }
+
+    if (!summaries.duplicate_counts.empty()) {
+      for (size_t input = 0; input < 2; ++input) {
+        const auto counts =
+            &summaries.duplicate_counts[(index * 2 + input) * depth_count];
+
+        for (size_t depth = 1; depth < depth_count; ++depth) {
+          if (counts[depth]) add_duplicates(depth, input, counts[depth]);
+        }
+      }
+    }
+  };
+
+  // Likewise for entry `i`.
+  const auto absorb_entry = [&](size_t i) {
+    const size_t offset = suffixes[i];
+    auto& innermost = stack.back();
+    innermost.first_occurence = std::min(innermost.first_occurence, offset);
+    if (do_maximal) {
+      innermost.left_context =
+          MergeLeftContexts(innermost.left_context, left_contexts_[i]);
+    }
+
+    if (count_documents && document_shared_prefixes_[i])
+      add_duplicates(document_shared_prefixes_[i], offset >= input0_size, 1);
+  };
+
+  // Called at the start of a block, before visiting entry `i`.  Finds the
+  // outermost open interval whose substrings, and those of the intervals
+  // inside it, can't pass the thresholds, and adds the entries up to its
+  // last entry to it without visiting them.  Returns the next entry to
+  // visit.
+  const auto skip_failing_interval = [&](size_t i) {
+    // Intervals whose last entry is known have already been checked, and
+    // are below those that haven't.
+    auto first_unchecked = stack.size();
+    while (first_unchecked > 1 && !stack[first_unchecked - 1].right)
+      --first_unchecked;
+
+    if (first_unchecked == stack.size()) return i;
+
+    // Inner intervals end first.  Blocks in which all shared prefixes are at
+    // least as long as that of an interval don't contain its last entry.
+    auto end = i;
+
+    for (auto p = stack.size(); p-- > first_unchecked;) {
+      const auto shared_prefix = stack[p].shared_prefix;
+
+      while (SharedPrefix(end) >= shared_prefix) {
+        if (end % kBlockSize == 0 &&
+            blocks.min_prefixes[end / kBlockSize] >= shared_prefix)
+          end += kBlockSize;
+        else
+          ++end;
+      }
+
+      stack[p].right = end;
+    }
+
+    auto p = first_unchecked;
+
+    for (; p < stack.size(); ++p) {
+      const auto& interval = stack[p];
+      const auto count = interval.right - interval.left + 1;
+      const auto input0_count =
+          Input0Rank(interval.right + 1) - Input0Rank(interval.left);
+
+      if (!MayPassThresholds(input0_count, count - input0_count,
+                             stack[p - 1].shared_prefix + 1, input0_threshold,
+                             input1_threshold, state))
+        break;
+    }
+
+    if (p == stack.size()) return i;
+
+    // The intervals inside the failing one are merged into it without being
+    // reported.  Their duplicates would have been passed on to it anyway.
+    while (stack.size() > p + 1) {
+      const auto closed = stack.back();
+      stack.pop_back();
+
+      auto& parent = stack.back();
+      parent.first_occurence =
+          std::min(parent.first_occurence, closed.first_occurence);
+      parent.left_context =
+          MergeLeftContexts(parent.left_context, closed.left_context);
+      parent.duplicates[0] += closed.duplicates[0];
+      parent.duplicates[1] += closed.duplicates[1];
+    }
+
+    // Its last entry is visited as usual, to close it.
+    const auto right = stack.back().right;
+
+    while (i < right) {
+      if (i % kBlockSize == 0 && i + kBlockSize <= right) {
+        absorb_summary(blocks, i / kBlockSize);
+
+        const auto end = i + kBlockSize;
+
+        for (; count_documents && i < end; ++i) {
+          if (document_shared_prefixes_[i]) {
+            add_duplicates(document_shared_prefixes_[i],
+                           static_cast<size_t>(suffixes[i]) >= input0_size, 1);
+          }
+        }
+
+        i = end;
+      } else {
+        absorb_entry(i++);
+      }
+    }
+
+    return i;
+  };
+
+  // Intervals that are still open at the end of the chunk are followed into
+  // the next chunks, until they are all closed.
+  auto current_chunk = chunk;
+  auto current_end = last_left;
+
+  for (auto i = chunk_begin(chunk); i < last_left || stack.size() > 1;) {
+    if (i >= current_end) {
+      while (chunk_end(current_chunk) <= i) ++current_chunk;
+      current_end = chunk_end(current_chunk);
+
+      // None of the open intervals end in a chunk whose shared prefixes are
+      // all at least as long as that of the innermost one.
+      if (i == chunk_begin(current_chunk) &&
+          chunks.min_prefixes[current_chunk] >= stack.back().shared_prefix) {
+        absorb_summary(chunks, current_chunk);
+        i = current_end;
+        continue;
+      }
+    }
+
+    if (skip_intervals && i % kBlockSize == 0 && stack.size() > 1)
+      i = skip_failing_interval(i);
+
+    visit(i++);
+  }
+
+  // Stable counting sort of the candidates by left boundary.  Intervals with
+  // the same left boundary are closed innermost first, so they are already
+  // ordered by decreasing length.
+  const auto first_left = chunk_begin(chunk);
+  std::vector<size_t> left_starts(last_left - first_left + 1);
+
+  for (const auto left : candidate_lefts) ++left_starts[left - first_left + 1];
+  std::partial_sum(left_starts.begin(), left_starts.end(),
+                   left_starts.begin());
+
+  std::vector<Candidate> sorted(candidate_lefts.size());
+
+  for (size_t i = 0; i < candidate_lefts.size(); ++i) {
+    sorted[left_starts[candidate_lefts[i] - first_left]++] =
+        candidates[first_candidate + i];
+  }
+
+  std::copy(sorted.begin(), sorted.end(),
+            candidates.begin() + first_candidate);
+}
+
+template <typename Index>
+void CommonSubstringFinder::AddSuffix(const ev::StringRef& substring,
+                                      const Index* suffixes, size_t first,
+                                      size_t count,
+                                      const size_t* document_hits,
+                                      const uint32_t* left_context,
+                                      size_t input0_threshold,
+                                      size_t input1_threshold,
+                                      ThreadState& state,
+                                      std::vector<Candidate>& candidates) const {
+  if (substring.size() > max_suffix_size_) return;
+
+  if (do_words) {
+    // Word n-grams end with a word character followed by a separator, or by
+    // the end of the text.  Since separators are the smallest bytes, those
+    // occurrences come first in the interval.
+    const auto length = substring.size();
+    if (IsWordSeparator(substring.data()[length - 1])) return;
+
+    const auto text_size = input0_size + input1_size + 1;
+    size_t begin = 0, end = count;
+
+    while (begin < end) {
+      const size_t mid = begin + (end - begin) / 2;
+      const size_t offset = suffixes[first + mid];
+
+      if (offset + length == text_size ||
+          IsWordSeparator(input0[offset + length]))
+        begin = mid + 1;
+      else
+        end = mid;
+    }
+
+    // The document counts and left context are for the whole interval.
+    if (begin < count) {
+      document_hits = nullptr;
+      left_context = nullptr;
+    }
+
+    count = begin;
+    if (count < 2) return;
+  }
+
+  if (count < input0_threshold && count < input1_threshold) return;
+
+  const auto offsets = suffixes + first;
+
+  size_t input0_hits = Input0Rank(first + count) - Input0Rank(first);
+  auto input1_hits = count - input0_hits;
+
+  if (input0_hits < input0_threshold && input1_hits < input1_threshold) return;
+
+  if (do_maximal) {
+    // The first and last suffixes share the next character only if all of
+    // them do.
+    if (SharesNextUnit(offsets[0], offsets[count - 1], substring.size()))
+      return;
+
+    auto context = left_context ? *left_context : left_contexts_[first];
+
+    for (size_t i = 1;
+         !left_context && i < count && context != kMixedLeftContext; ++i)
+      context = MergeLeftContexts(context, left_contexts_[first + i]);
+
+    if (context != kMixedLeftContext) {
+      size_t context_length;
+      LeftContext(offsets[0], &context_length);
+      if (substring.size() + context_length <= max_suffix_size_) return;
+    }
+  }
+
+  // Assuming input0_hits and input1_hits are numerators, these are the
+  // denominator for the same dimension.
+  double input0_denominator = 0.0, input1_denominator = 0.0;
+
+  if (do_document) {
+    input0_denominator = input0_doc_count_;
+    input1_denominator = input1_doc_count_;
+  } else if (do_probability || threshold) {
+    if (substring.size() < input0_n_gram_counts_.size())
+      input0_denominator = input0_n_gram_counts_[substring.size()];
+
+    if (substring.size() < input1_n_gram_counts_.size())
+      input1_denominator = input1_n_gram_counts_[substring.size()];
+  }
+
+  const auto prior_odds =
+      (input0_denominator + prior_bias) / (input1_denominator + prior_bias);
+
+  const auto get_log_odds = [&](size_t input0_hits, size_t input1_hits) {
+    const auto A_given_K_odds =
+        (input0_hits + prior_bias) / (input1_hits + prior_bias);
+    return std::log(A_given_K_odds / prior_odds);
+  };
+
+  uint64_t set_hash = 0;
+  std::vector<uint32_t> min_hashes;
+
+  // Each input has at most as many documents as entries.  Skip counting the
+  // documents if even the most extreme counts can't give a good enough
+  // candidate.
+  if (do_document && !document_hits &&
+      !MayPassThresholds(input0_hits, input1_hits, substring.size(),
+                         input0_threshold, input1_threshold, state))
+    return;
+
+  if (document_hits) {
+    input0_hits = document_hits[0];
+    input1_hits = document_hits[1];
+
+    if (input0_hits < input0_threshold && input1_hits < input1_threshold)
+      return;
+  } else if (do_document) {
+    auto& bits = state.documents.bits;
+    auto& words = state.documents.words;
+
+    if (bits.empty()) bits.resize((document_count_ + 31) / 32);
+
+    for (size_t i = 0; i < count; ++i) {
+      const auto doc_idx = SuffixDocument(first + i, offsets[i]);
+      auto& word = bits[doc_idx >> 5];
+      if (!word) words.emplace_back(doc_idx >> 5);
+      word |= 1 << (doc_idx & 31);
+    }
+
+    // Documents before this bit in this word are from input0.
+    const auto input0_word = input0_doc_count_ >> 5;
+    const auto input0_mask = (uint32_t(1) << (input0_doc_count_ & 31)) - 1;
+
+    // The hash of a set is the sum of the keys of the zero words, plus a
+    // function of the word and its key for the other words.
+    set_hash = document_hash_base_;
+
+    const auto add_word = [&](size_t index, uint32_t word) {
+      if (index < input0_word) {
+        input0_hits += BitCount(word);
+      } else if (index > input0_word) {
+        input1_hits += BitCount(word);
+      } else {
+        input0_hits += BitCount(word & input0_mask);
+        input1_hits += BitCount(word & ~input0_mask);
+      }
+
+      const auto key = document_hash_keys_[index];
+      set_hash += (word ^ key) + (word << 24ULL) - key;
+
+      // One-permutation MinHash: each document's hash picks a bin, and the
+      // smallest value in each bin is kept.
+      for (; !min_hashes.empty() && word; word &= word - 1) {
+        const auto hash =
+            MixBits(index * 32 + BitCount((word & -word) - 1));
+        const auto value = std::min<uint64_t>(hash >> 32, UINT32_MAX - 1);
+        auto& min_hash = min_hashes[hash % kMinHashBins];
+        min_hash = std::min<uint32_t>(min_hash, value);
+      }
+    };
+
+    input0_hits = 0;
+    input1_hits = 0;
+
+    if (jaccard_threshold > 0) min_hashes.assign(kMinHashBins, UINT32_MAX);
+
+    // When most words are set, reading them in order is faster.
+    if (words.size() * 8 > bits.size()) {
+      for (size_t i = 0; i < bits.size(); ++i) {
+        if (bits[i]) add_word(i, bits[i]);
+      }
+      std::fill(bits.begin(), bits.end(), 0);
+    } else {
+      for (const auto index : words) {
+        add_word(index, bits[index]);
+        bits[index] = 0;
+      }
+    }
+
+    words.clear();
+
+    if (input0_hits < input0_threshold && input1_hits < input1_threshold)
+      return;
+  }
+
+  const auto log_odds = get_log_odds(input0_hits, input1_hits);
+
+  if (threshold && std::fabs(log_odds) < threshold)
+    return;
+
+  if (std::fabs(log_odds) < state.min_log_odds[log_odds <= 0]) return;
+
+  candidates.push_back(Candidate{substring, log_odds, input0_hits, input1_hits,
+                                set_hash, std::move(min_hashes)});
+}
+
+bool CommonSubstringFinder::RanksBefore(const RankedCandidate& lhs,
+                                        const RankedCandidate& rhs) {
+  const auto lhs_log_odds = std::fabs(lhs.candidate.log_odds);
+  const auto rhs_log_odds = std::fabs(rhs.candidate.log_odds);
+
+  if (lhs_log_odds != rhs_log_odds) return lhs_log_odds > rhs_log_odds;
+  if (lhs.chunk != rhs.chunk) return lhs.chunk < rhs.chunk;
+  return lhs.index < rhs.index;
+}
+
+void CommonSubstringFinder::AddTopCandidates(
+    size_t chunk, std::vector<Candidate>& candidates,
+    ThreadState& state) const {
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    const RankedCandidate ranked{candidates[i], chunk, i};
+    const size_t input = ranked.candidate.log_odds <= 0;
+    auto& top = state.top[input];
+
+    if (top.size() < top_k) {
+      top.push_back(ranked);
+      std::push_heap(top.begin(), top.end(), RanksBefore);
+    } else if (RanksBefore(ranked, top.front())) {
+      std::pop_heap(top.begin(), top.end(), RanksBefore);
+      top.back() = ranked;
+      std::push_heap(top.begin(), top.end(), RanksBefore);
+    } else {
+      continue;
+    }
+
+    // Once the heap is full, candidates with a smaller absolute log odds than
+    // its lowest ranked one can't be among the best.  Those with the same
+    // may still be found earlier by another thread.
+    if (top.size() == top_k)
+      state.min_log_odds[input] = std::fabs(top.front().candidate.log_odds);
+  }
+
+  candidates.clear();
+}
+
+void CommonSubstringFinder::AddTopFeatures(std::vector<ThreadState>& states) {
+  std::vector<RankedCandidate> selected;
+
+  for (size_t input = 0; input < 2; ++input) {
+    std::vector<RankedCandidate> top;
+
+    for (auto& state : states) {
+      top.insert(top.end(), state.top[input].begin(), state.top[input].end());
+      state.top[input].clear();
+      state.top[input].shrink_to_fit();
+    }
+
+    if (top.size() > top_k) {
+      std::nth_element(top.begin(), top.begin() + top_k, top.end(),
+                       RanksBefore);
+      top.resize(top_k);
+    }
+
+    selected.insert(selected.end(), top.begin(), top.end());
+  }
+
+  std::sort(selected.begin(), selected.end(),
+            [](const RankedCandidate& lhs, const RankedCandidate& rhs) {
+              if (lhs.chunk != rhs.chunk) return lhs.chunk < rhs.chunk;
+              return lhs.index < rhs.index;
+            });
+
+  for (const auto& ranked : selected) AddFeature(ranked.candidate);
+}
+
+void CommonSubstringFinder::AddFeature(const Candidate& candidate) {
+  const auto& substring = candidate.substring;
+  const auto log_odds = candidate.log_odds;
+  const auto input0_hits = candidate.input0_hits;
+  const auto input1_hits = candidate.input1_hits;
+  const auto set_hash = candidate.set_hash;
+
+  if (filter_redundant_features) {
+    // The first feature with the same sign that contains this substring or
+    // is contained in it.
+    const auto index = FindRedundantFeature(substring, log_odds > 0);
+
+    // Features before it with the same document set may also make this
+    // substring redundant.
+    if (!allow_equal_sets) {
+      const auto& set_hashes = feature_indexes_[log_odds > 0].set_hashes;
+      const auto same_set = set_hashes.find(set_hash);
+
+      if (same_set != set_hashes.end()) {
+        for (const auto i : same_set->second) {
+          if (i > index) break;
+
+          const auto feature_str = features_[i].substring;
+
+          // We discard this feature if the existing feature is longer, or
+          // alphanumerically lower.
+          if (feature_str.size() > substring.size() ||
+              (feature_str.size() == substring.size() &&
+               feature_str < substring))
+            return;
+        }
+      }
+    }
+
+    if (index < features_.size()) {
+      auto& feature = features_[index];
+
+      // Existing feature is more predictive.
+      if (std::fabs(feature.log_odds) > std::fabs(log_odds)) return;
+
+      // Existing feature is equally predictive, but longer.
+      if (std::fabs(feature.log_odds) == std::fabs(log_odds) &&
+          feature.substring.size() > substring.size())
+        return;
+
+      IndexFeature(index, false);
+
+      feature.substring = substring;
+      feature.log_odds = log_odds;
+      feature.input0_hits = input0_hits;
+      feature.input1_hits = input1_hits;
+      feature.set_hash = set_hash;
+      feature.min_hashes = candidate.min_hashes;
+
+      IndexFeature(index, true);
+
+      return;
+    }
+  }
+
+  if (do_cover || filter_redundant_features) {
+    features_.emplace_back(substring, log_odds, input0_hits, input1_hits);
+    features_.back().set_hash = set_hash;
+    features_.back().min_hashes = candidate.min_hashes;
+    if (filter_redundant_features) IndexFeature(features_.size() - 1, true);
+  } else {
+    output(input0_hits, input1_hits, log_odds, substring);
+  }
+}
+
+void CommonSubstringFinder::IndexFeature(size_t index, bool add) {
+  const auto& feature = features_[index];
+  const auto& substring = feature.substring;
+  auto& feature_index = feature_indexes_[feature.log_odds > 0];
+
+  const auto hash = StringHash(substring);
+  auto& same_substring = feature_index.substrings[hash];
+  auto& length_counts = feature_index.length_counts;
+  auto& filter = feature_index.filter;
+
+  if (length_counts.size() <= substring.size())
+    length_counts.resize(substring.size() + 1);
+
+  if (add) {
+    if (filter.empty()) filter.resize((1 << FeatureIndex::kFilterBits) / 64);
+
+    const auto bit = hash >> (64 - FeatureIndex::kFilterBits);
+    filter[bit / 64] |= uint64_t(1) << (bit % 64);
+
+    same_substring.emplace_back(index);
+    ++length_counts[substring.size()];
+  } else {
+    same_substring.erase(
+        std::find(same_substring.begin(), same_substring.end(), index));
+    --length_counts[substring.size()];
+  }
+
+  for (size_t i = 0; i < substring.size(); ++i) {
+    const auto suffix = std::make_pair(substring.substr(i), index);
+
+    if (add)
+      feature_index.suffixes.emplace(suffix);
+    else
+      feature_index.suffixes.erase(suffix);
+  }
+
+  if (!allow_equal_sets) {
+    if (add)
+      feature_index.set_hashes[feature.set_hash].emplace(index);
+    else
+      feature_index.set_hashes[feature.set_hash].erase(index);
+  }
+}
+
+void CommonSubstringFinder::RemoveSimilarFeatures() {
+  // Visit the most predictive features first, so that each one is removed in
+  // favor of a better one.
+  std::vector<size_t> order(features_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [this](size_t lhs, size_t rhs) {
+    const auto& a = features_[lhs];
+    const auto& b = features_[rhs];
+    if (std::fabs(a.log_odds) != std::fabs(b.log_odds))
+      return std::fabs(a.log_odds) > std::fabs(b.log_odds);
+    return a.substring.size() > b.substring.size();
+  });
+
+  std::vector<bool> removed(features_.size());
+
+  for (const auto index : order) {
+    const auto& feature = features_[index];
+    if (feature.min_hashes.empty()) continue;
+
+    const auto positive = feature.log_odds > 0;
+
+    if (FindSimilarFeature(feature.min_hashes, positive) < features_.size()) {
+      removed[index] = true;
+      continue;
+    }
+
+    auto& bands = feature_indexes_[positive].bands;
+    for (size_t band = 0; band * kMinHashRows < kMinHashBins; ++band)
+      bands[BandHash(feature.min_hashes, band, kMinHashRows)].emplace_back(
+          index);
+  }
+
+  features_.erase(std::remove_if(features_.begin(), features_.end(),
+                                 [this, &removed](const Feature& feature) {
+                                   return removed[&feature - features_.data()];
+                                 }),
+                  features_.end());
+}
+
+size_t CommonSubstringFinder::FindSimilarFeature(
+    const std::vector<uint32_t>& min_hashes, bool positive) const {
+  const auto& bands = feature_indexes_[positive].bands;
+  auto result = features_.size();
+
+  for (size_t band = 0; band * kMinHashRows < min_hashes.size(); ++band) {
+    const auto same_band =
+        bands.find(BandHash(min_hashes, band, kMinHashRows));
+    if (same_band == bands.end()) continue;
+
+    for (const auto i : same_band->second) {
+      if (i < result &&
+          EstimateJaccard(features_[i].min_hashes, min_hashes) >=
+              jaccard_threshold)
+        result = i;
+    }
+  }
+
+  return result;
+}
+
+size_t CommonSubstringFinder::FindRedundantFeature(
+    const ev::StringRef& substring, bool positive) const {
+  const auto& feature_index = feature_indexes_[positive];
+  const auto& length_counts = feature_index.length_counts;
+  auto result = features_.size();
+
+  // Features contained in `substring` are found by looking up each of its
+  // substrings that is as long as some feature.
+  uint64_t prefix_hashes[kMaxLength + 2];
+  prefix_hashes[0] = 0;
+
+  for (size_t i = 0; i < substring.size(); ++i) {
+    prefix_hashes[i + 1] = prefix_hashes[i] * kStringHashBase +
+                           static_cast<unsigned char>(substring[i]);
+  }
+
+  uint64_t power = 1;
+
+  for (size_t length = 1;
+       length <= substring.size() && length < length_counts.size();
+       ++length) {
+    power *= kStringHashBase;
+
+    if (!length_counts[length]) continue;
+
+    for (size_t begin = 0; begin + length <= substring.size(); ++begin) {
+      const auto hash =
+          prefix_hashes[begin + length] - prefix_hashes[begin] * power;
+      const auto bit = hash >> (64 - FeatureIndex::kFilterBits);
+
+      if (!(feature_index.filter[bit / 64] & (uint64_t(1) << (bit % 64))))
+        continue;
+
+      const auto same_substring = feature_index.substrings.find(hash);
+
+      if (same_substring == feature_index.substrings.end()) continue;
+
+      for (const auto i : same_substring->second) {
+        if (i < result &&
+            features_[i].substring == substring.substr(begin, length))
+          result = i;
+      }
+    }
+  }
+
+  // Features that contain `substring` have a suffix that starts with it.
+  for (auto i = feature_index.suffixes.lower_bound(
+           std::make_pair(substring, size_t(0)));
+       i != feature_index.suffixes.end() &&
+       i->first.size() >= substring.size() &&
+       !std::memcmp(i->first.data(), substring.data(), substring.size());
+       ++i)
+    result = std::min(result, i->second);
+
+  return result;
+}
+
+std::vector<size_t> CommonSubstringFinder::CountNGrams(const char* text,
+                                                       size_t text_size) {
+  const char* text_end = text + text_size;
+  const char* ch, *next;
+
+  std::vector<size_t> result;
+
+  ch = text;
+
+  while (ch != text_end) {
+    if (!(next = (const char*)memchr(ch, kDocumentDelimiter, text_end - ch)))
+      next = text_end;
+
+    // Longer n-grams are never looked up.
+    const auto length = std::min(static_cast<size_t>(next - ch), max_suffix_size_);
+
+    if (result.size() <= length) result.resize(length + 1);
+
+    for (size_t i = 1; i <= length; ++i) ++result[i];
+
+    if (next == text_end) break;
+
+    ch = next + 1;
+  }
+
+  return result;
+}
+
+template <typename Index>
+void CommonSubstringFinder::FindCover(const Index* suffixes) {
+  const auto text_size = input0_size + input1_size + 1;
+
+  // The documents of `input0` containing each feature, found from the suffix
+  // array interval of its substring when the feature is first considered.
+  std::vector<std::vector<size_t>> postings(features_.size());
+  std::vector<bool> have_postings(features_.size());
+
+  const auto find_postings = [&](size_t index) {
+    const auto& substring = features_[index].substring;
+
+    // Compares the suffix at `offset`, truncated to the length of the
+    // substring, with the substring.
+    const auto compare = [&](size_t offset) {
+      const auto length = std::min(substring.size(), text_size - offset);
+      const auto result =
+          std::memcmp(input0 + offset, substring.data(), length);
+      if (result || length == substring.size()) return result;
+      return -1;
+    };
+
+    const auto begin = std::lower_bound(
+        suffixes, suffixes + suffix_count_, 0,
+        [&](Index offset, int) { return compare(offset) < 0; });
+    const auto end = std::upper_bound(
+        begin, suffixes + suffix_count_, 0,
+        [&](int, Index offset) { return compare(offset) > 0; });
+
+    auto& documents = postings[index];
+
+    for (auto i = begin; i != end; ++i) {
+      if (static_cast<size_t>(*i) < input0_size)
+        documents.emplace_back(DocIdxForOffset(*i));
+    }
+
+    std::sort(documents.begin(), documents.end());
+    documents.erase(std::unique(documents.begin(), documents.end()),
+                    documents.end());
+    have_postings[index] = true;
+  };
+
+  std::vector<uint64_t> remaining((input0_doc_count_ + 63) / 64);
+  for (size_t i = 0; i < input0_doc_count_; ++i)
+    remaining[i >> 6] |= uint64_t(1) << (i & 63);
+  auto remaining_count = input0_doc_count_;
+
+  // Features are picked greedily by how many remaining documents they cover,
+  // those with positive log odds first, and then by log odds.  Since the
+  // coverage of a feature only decreases, the queue holds upper bounds,
+  // starting with the document counts, which are updated when they reach
+  // the top.
+  struct Entry {
+    bool positive;
+    size_t coverage;
+    float log_odds;
+    size_t index;
+
+    bool operator<(const Entry& rhs) const {
+      if (positive != rhs.positive) return positive < rhs.positive;
+      if (coverage != rhs.coverage) return coverage < rhs.coverage;
+      if (log_odds != rhs.log_odds) return log_odds < rhs.log_odds;
+      return index > rhs.index;
+    }
+  };
+
+  std::priority_queue<Entry> queue;
+
+  for (size_t i = 0; i < features_.size(); ++i) {
+    const auto& feature = features_[i];
+    if (feature.input0_hits)
+      queue.push(Entry{feature.log_odds > 0, feature.input0_hits,
+                       feature.log_odds, i});
+  }
+
+  while (!queue.empty() && remaining_count) {
+    auto entry = queue.top();
+    queue.pop();
+
+    if (!have_postings[entry.index]) find_postings(entry.index);
+
+    const auto& documents = postings[entry.index];
+
+    size_t coverage = 0;
+    for (const auto document : documents)
+      coverage += (remaining[document >> 6] >> (document & 63)) & 1;
+
+    if (!coverage) continue;
+
+    if (coverage < entry.coverage) {
+      entry.coverage = coverage;
+      queue.push(entry);
+      continue;
+    }
+
+    for (const auto document : documents)
+      remaining[document >> 6] &= ~(uint64_t(1) << (document & 63));
+    remaining_count -= coverage;
+
+    const auto& feature = features_[entry.index];
+    if (coverage > static_cast<size_t>(cover_threshold))
+      output(coverage, 0, feature.log_odds, feature.substring);
+  }
+}
+
+void CommonSubstringFinder::FindDocumentBounds(const char* text,
+                                               size_t text_size) {
+  const char* text_end = text + text_size;
+  const char* ch, *next;
+
+  auto& document_starts = document_starts_storage_;
+
+  document_starts.emplace_back(0);
+  ch = text;
+
+  while (ch != text_end) {
+    if (!(next = (const char*)memchr(ch, kDocumentDelimiter, text_end - ch)))
+      next = text_end;
+
+    document_starts.emplace_back(next - text);
+
+    if (next < input1)
+      ++input0_doc_count_;
+    else
+      ++input1_doc_count_;
+
+    if (next == text_end) break;
 
-// Character used to separate documents in document mode.
-static const char kDocumentDelimiter = '\0';
+    ch = next + 1;
+  }
 
-// Counts the number of bits set in an 32 bit integer.
-unsigned int BitCount(uint32_t n) {
-  n = ((0xaaaaaaaa & n) >> 1) + (0x55555555 & n);
-  n = ((0xcccccccc & n) >> 2) + (0x33333333 & n);
-  n = ((0xf0f0f0f0 & n) >> 4) + (0x0f0f0f0f & n);
-  n = ((0xff00ff00 & n) >> 8) + (0x00ff00ff & n);
-  n = ((0xffff0000 & n) >> 16) + (0x0000ffff & n);
-  return n;
+  if (document_starts.size() > 1) document_starts.pop_back();
+
+  SetDocumentStarts(document_starts.data(), document_starts.size());
 }
 
-}  // namespace
+size_t CommonSubstringFinder::SharedPrefixOverflow(size_t index) const {
+  const auto end = shared_prefix_overflow_ + shared_prefix_overflow_count_;
+  const auto i = std::lower_bound(
+      shared_prefix_overflow_, end, std::pair<uint64_t, uint64_t>(index, 0));
+  assert(i != end && i->first == index);
+  return i->second;
+}
 
-void CommonSubstringFinder::BuildLCPArray(std::vector<size_t>& result,
-                                          const char* text, size_t text_length,
-                                          const saidx_t* suffixes,
-                                          size_t suffix_count) {
-  static const size_t kInvalidOffset = static_cast<size_t>(-1);
+void CommonSubstringFinder::StoreSharedPrefix(size_t index, size_t length) {
+  if (length < kSharedPrefixOverflow) {
+    shared_prefixes_storage_[index] = length;
+    return;
+  }
+
+  shared_prefixes_storage_[index] = kSharedPrefixOverflow;
+
+#pragma omp critical
+  shared_prefix_overflow_storage_.emplace_back(index, length);
+}
+
+void CommonSubstringFinder::FinishSharedPrefixes() {
+  std::sort(shared_prefix_overflow_storage_.begin(),
+            shared_prefix_overflow_storage_.end());
+  SetSharedPrefixes(shared_prefixes_storage_.data(),
+                    shared_prefix_overflow_storage_.data(),
+                    shared_prefix_overflow_storage_.size());
+}
 
-  const char* end = text + text_length;
+void CommonSubstringFinder::SetSharedPrefixes(
+    const uint8_t* shared_prefixes,
+    const std::pair<uint64_t, uint64_t>* overflow, size_t overflow_count) {
+  shared_prefixes_ = shared_prefixes;
+  shared_prefix_overflow_ = overflow;
+  shared_prefix_overflow_count_ = overflow_count;
+}
 
-  std::vector<size_t> inverse;
+void CommonSubstringFinder::CapSharedPrefixes() {
+  const auto max_shared_prefix = max_suffix_size_ + 1;
 
-  inverse.resize(text_length, kInvalidOffset);
+  shared_prefixes_storage_.resize(suffix_count_);
 
-  for (size_t i = 0; i + 1 < suffix_count; ++i) inverse[suffixes[i]] = i;
+  for (size_t i = 0; i < suffix_count_; ++i)
+    shared_prefixes_storage_[i] = std::min(SharedPrefix(i), max_shared_prefix);
 
-  result.resize(suffix_count);
+  shared_prefix_overflow_storage_.clear();
 
-  size_t h = 0;
+  SetSharedPrefixes(shared_prefixes_storage_.data(), nullptr, 0);
+}
 
-  for (size_t i = 0; i < text_length; ++i) {
-    size_t x = inverse[i];
+void CommonSubstringFinder::SetDocumentStarts(const size_t* document_starts,
+                                              size_t count) {
+  document_starts_ = document_starts;
+  document_count_ = count;
 
-    if (x == kInvalidOffset) {
-      if (h > 0) --h;
+  document_search_ = EytzingerArray(document_starts, count);
+}
 
-      continue;
-    }
+template <typename Index>
+size_t CommonSubstringFinder::FilterSuffixes(Index* input, const char* text,
+                                             size_t count) {
+  auto end = input + count;
+
+  auto output = input;
 
-    size_t j = suffixes[x + 1];
+  for (auto i = input; i != end; ++i) {
+    if (IsSuffixStart(text, *i)) *output++ = *i;
+  }
+
+  return output - input;
+}
 
-    /* The shared prefix of a string starting at offset X is at least as long
-     * as the one starting at offset X-1, minus 1.  */
+bool CommonSubstringFinder::IsSuffixStart(const char* text,
+                                          size_t offset) const {
+  if (do_color && (offset & 1)) return false;
 
-    const char* p1 = text + i + h;
-    const char* p0 = text + j + h;
+  auto ch = static_cast<unsigned char>(text[offset]);
 
-    while (p1 != end && p0 != end && (*p1 != kDocumentDelimiter) &&
-           *p1++ == *p0++)
-      ++h;
+  if (ch == kDocumentDelimiter) return false;
 
-    result[x] = h;
+  // Skip UTF-8 continuation bytes; we're not interested in substrings
+  // starting inside characters.
+  if ((ch & 0xc0) == 0x80) return false;
 
-    if (h > 0) --h;
+  if (do_words) {
+    if (IsWordSeparator(ch)) return false;
+    if (offset && !IsWordSeparator(text[offset - 1])) return false;
   }
+
+  return true;
 }
 
-void CommonSubstringFinder::FindSubstrings() {
-  size_t input0_threshold, input1_threshold;
+uint32_t CommonSubstringFinder::LeftContext(size_t offset,
+                                            size_t* length) const {
+  const auto text = input0;
+  auto start = offset;
 
-  if (do_document && threshold_count == -1) {
-    input0_threshold = input0_doc_count_ * threshold_percent / 100;
-    input1_threshold = input1_doc_count_ * threshold_percent / 100;
+  if (do_words) {
+    // Skip the separators, then the word before them.
+    while (start && IsWordSeparator(text[start - 1]) &&
+           text[start - 1] != kDocumentDelimiter)
+      --start;
+
+    if (!start || text[start - 1] == kDocumentDelimiter)
+      return kMixedLeftContext;
+
+    while (start && !IsWordSeparator(text[start - 1])) --start;
+  } else if (do_color) {
+    if (start < 2) return kMixedLeftContext;
+    start -= 2;
   } else {
-    input0_threshold = threshold_count;
-    input1_threshold = threshold_count;
+    if (!start) return kMixedLeftContext;
+    --start;
+
+    // Include the whole UTF-8 character.
+    while (start && offset - start < 4 && (text[start] & 0xc0) == 0x80)
+      --start;
   }
 
-  if (suffixes_.empty()) return;
+  // FNV-1a hash of the context.
+  uint32_t hash = 2166136261U;
 
-  std::vector<size_t> shared_prefixes;
+  for (auto i = start; i < offset; ++i) {
+    if (text[i] == kDocumentDelimiter) return kMixedLeftContext;
+    hash = (hash ^ static_cast<unsigned char>(text[i])) * 16777619U;
+  }
 
-  shared_prefixes.reserve(suffixes_.size());
+  if (length) *length = offset - start;
 
-  BuildLCPArray(shared_prefixes, input0, input0_size + input1_size + 1,
-                &suffixes_[0], suffixes_.size());
+  // The hash of a real context is never mistaken for mixed contexts, at the
+  // cost of rarely treating two contexts as different.
+  return (hash == kMixedLeftContext) ? 1 : hash;
+}
 
-  // TODO(mortehu): Check word end boundary when do_words is set.
+template <typename Index>
+void CommonSubstringFinder::BuildLeftContexts(const Index* suffixes) {
+  left_contexts_.resize(suffix_count_);
 
-  for (size_t i = 1; i < suffixes_.size(); ++i) {
-    const auto previous_prefix_length = (i > 1) ? shared_prefixes[i - 2] : 0;
-    const auto prefix_length = shared_prefixes[i - 1];
+#pragma omp parallel for
+  for (size_t i = 0; i < suffix_count_; ++i)
+    left_contexts_[i] = LeftContext(suffixes[i]);
+}
 
-    // Skip shared prefixes that are duplicates, or shorter versions of
-    // previous previous ones.
-    if (prefix_length <= previous_prefix_length) continue;
+bool CommonSubstringFinder::SharesNextUnit(size_t lhs, size_t rhs,
+                                           size_t length) const {
+  const auto text = input0;
+  const auto text_size = input0_size + input1_size + 1;
 
-    if (do_words && suffixes_[i] > 0 && !std::isspace(input0[suffixes_[i] - 1]))
-      continue;
+  // Returns true if a character or word of the suffix at `offset` ends
+  // before byte `i`.
+  const auto unit_ends = [&](size_t offset, size_t i) {
+    if (offset + i == text_size) return true;
 
-    // Index of the first suffix matching the current prefix.
-    const auto first_match = i - 1;
+    const auto ch = static_cast<unsigned char>(text[offset + i]);
 
-    auto first_occurence = std::min(suffixes_[i - 1], suffixes_[i]);
+    if (do_words)
+      return IsWordSeparator(ch) && !IsWordSeparator(text[offset + i - 1]);
+    if (do_color) return !((i - length) & 1);
+    return (ch & 0xc0) != 0x80;
+  };
 
-    size_t j = i + 1;
-    size_t count = 2;
+  for (auto i = length; i < max_suffix_size_; ++i) {
+    if (lhs + i == text_size || rhs + i == text_size) return false;
 
-    // Collect counts for all prefixes of the current prefix.  Shorter prefixes
-    // are guaranteed to have higher counts than longer prefixes.
-    for (size_t prefix_prefix_length = prefix_length;
-         j <= suffixes_.size() &&
-             prefix_prefix_length > previous_prefix_length;) {
-      // Avoid prefixes that terminate inside a UTF-8 character.
-      if (first_occurence + prefix_prefix_length < input0_size && (input0[first_occurence + prefix_prefix_length] & 0xc0) == 0x80) {
-        --prefix_prefix_length;
-        continue;
-      }
+    if (text[lhs + i] != text[rhs + i] || text[lhs + i] == kDocumentDelimiter)
+      return false;
 
-      if (shared_prefixes[j - 1] < prefix_prefix_length) {
-        AddSuffix(ev::StringRef(input0 + first_occurence, prefix_prefix_length),
-                  &suffixes_[first_match], count, input0_threshold,
-                  input1_threshold);
+    if (unit_ends(lhs, i + 1) && unit_ends(rhs, i + 1)) return true;
+  }
 
-        if (!skip_samecount_prefixes) {
-          --prefix_prefix_length;
-        } else {
-          prefix_prefix_length = shared_prefixes[j - 1];
-        }
+  return false;
+}
 
-        // Skip odd lengths when we're doing coloring.
-        if (do_color) prefix_prefix_length &= ~1ULL;
+template <typename Index>
+void CommonSubstringFinder::BuildSuffixArray(std::vector<Index>& suffixes,
+                                             SuffixArrayEngine engine) {
+  const auto text_size = input0_size + input1_size + 1;
 
-        continue;
-      }
+  suffixes.resize(text_size);
 
-      if (suffixes_[j] < first_occurence) first_occurence = suffixes_[j];
+  {
+    PhaseTimer timer("Suffix sorting", print_timings);
 
-      ++count;
-      ++j;
-    }
+    if (engine == SuffixArrayEngine::kInducedSort)
+      InducedSortSuffixes(reinterpret_cast<const unsigned char*>(input0),
+                          &suffixes[0], text_size);
+    else
+      SortSuffixes(input0, &suffixes[0], text_size);
+  }
+
+  {
+    PhaseTimer timer("Suffix filtering", print_timings);
+    suffixes.resize(FilterSuffixes(&suffixes[0], input0, text_size));
+  }
+
+  suffixes_ = suffixes.data();
+  suffix_count_ = suffixes.size();
+
+  if (suffix_count_) {
+    PhaseTimer timer("LCP array", print_timings);
+    BuildLCPArray(suffixes.data(), suffix_count_);
   }
+
+  FinishSharedPrefixes();
 }
 
-void CommonSubstringFinder::AddSuffix(const ev::StringRef& substring,
-                                      const saidx_t* offsets, size_t count,
-                                      size_t input0_threshold,
-                                      size_t input1_threshold) {
-  if (substring.size() > max_suffix_size_) return;
+size_t CommonSubstringFinder::SuffixBucket(size_t offset) const {
+  const auto text = reinterpret_cast<const unsigned char*>(input0);
+  const auto text_size = input0_size + input1_size + 1;
 
-  if (count < input0_threshold && count < input1_threshold) return;
+  return text[offset] * 257 +
+         ((offset + 1 < text_size) ? text[offset + 1] + 1 : 0);
+}
 
-  size_t input0_hits = 0;
+std::vector<size_t> CommonSubstringFinder::CountSuffixBuckets() const {
+  const auto text_size = input0_size + input1_size + 1;
 
-  for (size_t i = 0; i < count; ++i) {
-    if (offsets[i] < static_cast<saidx_t>(input0_size)) ++input0_hits;
-  }
+  std::vector<size_t> result(kSuffixBucketCount);
 
-  auto input1_hits = count - input0_hits;
+  for (size_t i = 0; i < text_size; ++i) {
+    if (IsSuffixStart(input0, i)) ++result[SuffixBucket(i)];
+  }
 
-  if (input0_hits < input0_threshold && input1_hits < input1_threshold) return;
+  return result;
+}
 
-  uint64_t set_hash = 0;
+template <typename Index>
+void CommonSubstringFinder::SortSuffixBuckets(
+    const std::vector<size_t>& bucket_sizes, size_t first_bucket,
+    size_t last_bucket, size_t max_depth, Index* output) const {
+  const auto text = reinterpret_cast<const unsigned char*>(input0);
+  const auto text_size = input0_size + input1_size + 1;
 
-  if (do_document) {
-    const auto doc_bits_size = (document_starts_.size() + 31) / 32;
-    uint32_t doc_bits[doc_bits_size];
-    memset(doc_bits, 0, sizeof(doc_bits));
+  std::vector<size_t> bucket_starts(last_bucket - first_bucket + 1);
 
-    input0_hits = 0;
-    input1_hits = 0;
+  for (size_t i = first_bucket; i < last_bucket; ++i) {
+    bucket_starts[i - first_bucket + 1] =
+        bucket_starts[i - first_bucket] + bucket_sizes[i];
+  }
 
-    for (size_t i = 0; i < count; ++i) {
-      const auto doc_idx = DocIdxForOffset(offsets[i]);
-      doc_bits[doc_idx >> 5] |= 1 << (doc_idx & 31);
-    }
+  auto bucket_ends = bucket_starts;
 
-    size_t j;
+  for (size_t i = 0; i < text_size; ++i) {
+    const auto bucket = SuffixBucket(i);
 
-    for (j = 0; j + 32 < input0_doc_count_; j += 32)
-      input0_hits += BitCount(doc_bits[j >> 5]);
+    if (bucket >= first_bucket && bucket < last_bucket &&
+        IsSuffixStart(input0, i))
+      output[bucket_ends[bucket - first_bucket]++] = i;
+  }
 
-    for (; j < input0_doc_count_; ++j) {
-      if (doc_bits[j >> 5] & (1 << (j & 31))) ++input0_hits;
-    }
-    for (; j & 31; ++j) {
-      if (doc_bits[j >> 5] & (1 << (j & 31))) ++input1_hits;
+  // Suffixes in the same bucket share their first two bytes, or are the last
+  // suffix of the text, which is alone in its bucket.
+  const auto less = [text, text_size](Index lhs, Index rhs) {
+    const size_t lhs_size = text_size - lhs, rhs_size = text_size - rhs;
+    const auto cmp =
+        memcmp(text + lhs + 2, text + rhs + 2, std::min(lhs_size, rhs_size) - 2);
+    if (cmp) return cmp < 0;
+    return lhs_size < rhs_size;
+  };
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < last_bucket - first_bucket; ++i) {
+    const auto begin = output + bucket_starts[i];
+    const auto end = output + bucket_starts[i + 1];
+
+    if (end - begin <= 1) continue;
+
+    if (!max_depth) {
+      std::sort(begin, end, less);
+    } else if ((first_bucket + i) % 257 <= 1) {
+      // The second byte is a delimiter, or past the end of the text.
+      std::sort(begin, end);
+    } else {
+      SortSuffixesToDepth(text, text_size, begin, end - begin, 2, max_depth);
     }
-    for (j >>= 5; j < doc_bits_size; ++j) input1_hits += BitCount(doc_bits[j]);
+  }
+}
 
-    if (input0_hits < input0_threshold && input1_hits < input1_threshold)
-      return;
+template <typename Index>
+void CommonSubstringFinder::BuildSparseSuffixArray(std::vector<Index>& suffixes,
+                                                   size_t max_depth) {
+  const auto text_size = input0_size + input1_size + 1;
 
-    std::minstd_rand rng(123);
-    std::uniform_int_distribution<uint64_t> dist;
+  {
+    PhaseTimer timer(max_depth ? "Bounded suffix sorting"
+                               : "Sparse suffix sorting",
+                     print_timings);
 
-    for (size_t i = 0; i < doc_bits_size; ++i)
-      set_hash += (doc_bits[i] ^ dist(rng)) + (doc_bits[i] << 24ULL);
+    const auto bucket_sizes = CountSuffixBuckets();
+
+    suffixes.resize(
+        std::accumulate(bucket_sizes.begin(), bucket_sizes.end(), size_t(0)));
+
+    SortSuffixBuckets(bucket_sizes, 0, kSuffixBucketCount, max_depth,
+                      suffixes.data());
   }
 
-  // Assuming input0_hits and input1_hits are numerators, these are the
-  // denominator for the same dimension.
-  double input0_denominator = 0.0, input1_denominator = 0.0;
+  suffixes_ = suffixes.data();
+  suffix_count_ = suffixes.size();
 
-  if (do_document) {
-    input0_denominator = input0_doc_count_;
-    input1_denominator = input1_doc_count_;
-  } else {
-    if (substring.size() < input0_n_gram_counts_.size())
-      input0_denominator = input0_n_gram_counts_[substring.size()];
+  if (suffix_count_) {
+    PhaseTimer timer("LCP array", print_timings);
 
-    if (substring.size() < input1_n_gram_counts_.size())
-      input1_denominator = input1_n_gram_counts_[substring.size()];
+    // Adjacent suffixes are compared directly, which needs no memory beyond
+    // the output.
+    shared_prefixes_storage_.resize(suffix_count_);
+    shared_prefix_overflow_storage_.clear();
+
+#pragma omp parallel for
+    for (size_t i = 1; i < suffix_count_; ++i) {
+      StoreSharedPrefix(i - 1, CommonPrefixLength(input0, text_size,
+                                                   suffixes[i - 1], suffixes[i],
+                                                   max_suffix_size_ + 1));
+    }
+
+    StoreSharedPrefix(suffix_count_ - 1, 0);
   }
 
-  const auto A_given_K_odds =
-      (input0_hits + prior_bias) / (input1_hits + prior_bias);
-  const auto prior_odds =
-      (input0_denominator + prior_bias) / (input1_denominator + prior_bias);
-  const auto log_odds = std::log(A_given_K_odds / prior_odds);
+  FinishSharedPrefixes();
+}
 
-  if (threshold && std::fabs(log_odds) < threshold)
-    return;
+template <typename Index>
+void CommonSubstringFinder::BuildSuffixArrayExternal() {
+  PhaseTimer timer("External suffix sorting", print_timings);
 
-  std::lock_guard<std::mutex> lk(output_mutex_);
+  const auto text_size = input0_size + input1_size + 1;
 
-  if (filter_redundant_features) {
-    for (auto i = features_.begin(); i != features_.end(); ++i) {
-      auto& feature = *i;
+  const auto bucket_sizes = CountSuffixBuckets();
 
-      if ((feature.log_odds > 0) != (log_odds > 0)) continue;
+  const auto max_pass_size =
+      std::max(memory_limit / sizeof(Index), static_cast<size_t>(1));
 
-      const auto feature_str = feature.substring;
+  std::string suffixes_path, shared_prefixes_path;
+  auto suffixes_file = CreateTemporaryFile(suffixes_path);
+  auto shared_prefixes_file = CreateTemporaryFile(shared_prefixes_path);
 
-      if (!allow_equal_sets && feature.set_hash == set_hash) {
-        // We discard this feature if the existing feature is longer, or
-        // alphanumerically lower.
-        if (feature_str.size() > substring.size() ||
-            (feature_str.size() == substring.size() &&
-             feature_str < substring))
-          return;
-      }
+  // Shared prefixes are only needed up to the longest substring we output,
+  // plus one byte, so that FindSubstrings() still sees where longer shared
+  // prefixes end.
+  const auto max_shared_prefix = max_suffix_size_ + 1;
 
-      if (substring.begin() != feature_str.begin() &&
-          !substring.contains(feature_str) &&
-          !feature_str.contains(substring))
-        continue;
+  std::vector<Index> pass;
+  size_t previous_suffix = 0;
+  bool warned = false;
 
-      // Existing feature is more predictive.
-      if (std::fabs(feature.log_odds) > std::fabs(log_odds)) return;
+  shared_prefix_overflow_storage_.clear();
 
-      // Existing feature is equally predictive, but longer.
-      if (std::fabs(feature.log_odds) == std::fabs(log_odds) &&
-          feature.substring.size() > substring.size())
-        return;
+  for (size_t first_bucket = 0, last_bucket;
+       first_bucket < kSuffixBucketCount; first_bucket = last_bucket) {
+    size_t pass_size = 0;
+    last_bucket = first_bucket;
 
-      feature.substring = substring;
-      feature.log_odds = log_odds;
-      feature.input0_hits = input0_hits;
-      feature.input1_hits = input1_hits;
-      feature.set_hash = set_hash;
+    do {
+      pass_size += bucket_sizes[last_bucket++];
+    } while (last_bucket < kSuffixBucketCount &&
+             pass_size + bucket_sizes[last_bucket] <= max_pass_size);
 
-      return;
+    if (!pass_size) continue;
+
+    if (pass_size > max_pass_size && !warned) {
+      warnx("%zu suffixes start with the same two bytes, exceeding the "
+            "memory limit",
+            pass_size);
+      warned = true;
     }
-  }
 
-  if (do_cover || filter_redundant_features) {
-    features_.emplace_back(substring, log_odds, input0_hits, input1_hits);
-  } else {
-    output(input0_hits, input1_hits, log_odds, substring);
-  }
-}
+    pass.resize(pass_size);
 
-size_t CommonSubstringFinder::DocIdxForOffset(saidx_t offset) const {
-  // This implementation runs a binary search with a fixed number of iterations,
-  // enough to guarantee a correct results.  This removes a conditional branch
-  // from the innter loop.
+    SortSuffixBuckets(bucket_sizes, first_bucket, last_bucket, 0,
+                      pass.data());
 
-  auto first = document_starts_.data();
-  auto len = document_starts_.size();
+    WriteArray(suffixes_file, suffixes_path, pass.data(), pass.size());
 
-  auto mid = first + len - document_binsearch_first_mid_;
+    // Each shared prefix length refers to the suffix before it, so we write
+    // one less than the number of suffixes until the final entry.
+    for (const auto suffix : pass) {
+      if (suffix_count_) {
+        const auto shared_prefix = CommonPrefixLength(
+            input0, text_size, previous_suffix, suffix, max_shared_prefix);
 
-  if (*mid < offset) first = mid;
-  len = document_binsearch_first_mid_;
+        uint8_t byte = shared_prefix;
+        if (shared_prefix >= kSharedPrefixOverflow) {
+          byte = kSharedPrefixOverflow;
+          shared_prefix_overflow_storage_.emplace_back(suffix_count_ - 1,
+                                                       shared_prefix);
+        }
+
+        WriteArray(shared_prefixes_file, shared_prefixes_path, &byte, 1);
+      }
+
+      previous_suffix = suffix;
+      ++suffix_count_;
+    }
+  }
 
-  for (auto i = document_binsearch_count_; i; --i) {
-    len >>= 1;
-    if (first[len] < offset) first += len;
+  if (suffix_count_) {
+    const uint8_t last_shared_prefix = 0;
+    WriteArray(shared_prefixes_file, shared_prefixes_path, &last_shared_prefix,
+               1);
   }
 
-  return first - document_starts_.data();
+  suffixes_ = MapTemporaryFile(suffixes_file, suffixes_path);
+  SetSharedPrefixes(reinterpret_cast<const uint8_t*>(MapTemporaryFile(
+                        shared_prefixes_file, shared_prefixes_path)),
+                    shared_prefix_overflow_storage_.data(),
+                    shared_prefix_overflow_storage_.size());
 }
 
-std::vector<size_t> CommonSubstringFinder::CountNGrams(const char* text,
-                                                       size_t text_size) {
-  const char* text_end = text + text_size;
-  const char* ch, *next;
+template <typename Index>
+void CommonSubstringFinder::BuildArrays(std::vector<Index>& suffixes) {
+  const auto text_size = input0_size + input1_size + 1;
 
-  std::vector<size_t> result;
+  // Peak memory use of in-memory construction: the suffix array, and the
+  // inverse suffix array and shared prefix array used by BuildLCPArray().
+  const auto in_memory_size = text_size * (sizeof(Index) + 2 * sizeof(size_t));
 
-  ch = text;
+  if (memory_limit && in_memory_size > memory_limit) {
+    BuildSuffixArrayExternal<Index>();
+    return;
+  }
 
-  while (ch != text_end) {
-    if (!(next = (const char*)memchr(ch, kDocumentDelimiter, text_end - ch)))
-      next = text_end;
+  auto engine = sa_engine;
+  if (engine == SuffixArrayEngine::kAuto) engine = ChooseSuffixArrayEngine();
 
-    if (result.size() <= (size_t)(next - ch)) result.resize(next - ch + 1);
+  switch (engine) {
+    case SuffixArrayEngine::kBounded:
+      BuildSparseSuffixArray(suffixes, max_suffix_size_ + 1);
+      break;
 
-    for (size_t i = 1; i <= (size_t)(next - ch); ++i) ++result[i];
+    case SuffixArrayEngine::kSparse:
+      BuildSparseSuffixArray(suffixes, 0);
+      break;
 
-    if (next == text_end) break;
+    default:
+      BuildSuffixArray(suffixes, engine);
+  }
+}
 
-    ch = next + 1;
+SuffixArrayEngine CommonSubstringFinder::ChooseSuffixArrayEngine() const {
+  const auto text_size = input0_size + input1_size + 1;
+
+  size_t eligible = 0;
+  for (size_t i = 0; i < text_size; ++i) {
+    if (IsSuffixStart(input0, i)) ++eligible;
   }
 
-  return result;
+  // When most suffixes would be discarded after sorting, e.g. with --color,
+  // or in text where most characters take several bytes, sorting only the
+  // remaining ones is faster.
+  if (eligible < text_size / 2) return SuffixArrayEngine::kBounded;
+
+#ifdef _OPENMP
+  // libdivsufsort and SA-IS are sequential, while the bounded engine sorts
+  // its buckets in parallel.
+  if (omp_get_max_threads() > 1 && text_size >= (64 << 20))
+    return SuffixArrayEngine::kBounded;
+#endif
+
+  // libdivsufsort is faster than our SA-IS on every kind of input we have
+  // measured, including highly repetitive input, so SA-IS is never chosen
+  // automatically.
+  return SuffixArrayEngine::kDivSufSort;
 }
 
-void CommonSubstringFinder::FindCover(void) {
-  std::list<std::pair<const char*, size_t>> remaining_documents;
-  const char* start = input0, *end;
-  size_t i;
-
-  std::sort(features_.begin(), features_.end(),
-            [](const auto& lhs,
-               const auto& rhs) { return lhs.log_odds > rhs.log_odds; });
+template <typename Index>
+void CommonSubstringFinder::MergeSuffixes(const Index* old_suffixes,
+                                          size_t old_text_size,
+                                          std::vector<Index>& suffixes) {
+  const auto text = input0;
+  const auto text_size = input0_size + input1_size + 1;
+  const auto max_shared_prefix = max_suffix_size_ + 1;
+
+  const auto less = [text, text_size](Index lhs, Index rhs) {
+    const size_t lhs_size = text_size - lhs, rhs_size = text_size - rhs;
+    const auto cmp =
+        memcmp(text + lhs, text + rhs, std::min(lhs_size, rhs_size));
+    if (cmp) return cmp < 0;
+    return lhs_size < rhs_size;
+  };
+
+  // Existing suffixes keep their relative order, except for those that were
+  // a prefix of the following suffix, all the way to the end of the old text.
+  // They now continue into the new documents, so they are sorted again along
+  // with the new suffixes.  The shared prefix length of two suffixes that
+  // become adjacent when this happens is the minimum over the range between
+  // them.
+  std::vector<Index> kept, added;
+  std::vector<size_t> kept_shared_prefixes;
+
+  {
+    PhaseTimer timer("Existing suffixes", print_timings);
+
+    kept.reserve(suffix_count_);
+    kept_shared_prefixes.reserve(suffix_count_);
+
+    for (size_t i = 0; i < suffix_count_; ++i) {
+      const size_t suffix = old_suffixes[i];
+      const auto shared_prefix = SharedPrefix(i);
+
+      if (i + 1 < suffix_count_) {
+        const size_t next = old_suffixes[i + 1];
+        const auto end = suffix + shared_prefix;
+
+        // A shared prefix that ends before the old end of the text, at
+        // anything other than a delimiter, ends at a mismatch.
+        if (next < suffix &&
+            (end >= old_text_size || text[end] == kDocumentDelimiter ||
+             shared_prefix >= max_shared_prefix) &&
+            !memcmp(text + suffix, text + next, old_text_size - suffix)) {
+          added.emplace_back(suffix);
+
+          if (!kept.empty()) {
+            kept_shared_prefixes.back() =
+                std::min(kept_shared_prefixes.back(), shared_prefix);
+          }
+
+          continue;
+        }
+      }
 
-  for (i = 0; i < document_starts_.size(); ++i) {
-    if (document_starts_[i] >= static_cast<saidx_t>(input0_size)) break;
+      kept.emplace_back(suffix);
+      kept_shared_prefixes.emplace_back(shared_prefix);
+    }
+  }
 
-    end = input0 + document_starts_[i];
+  {
+    PhaseTimer timer("New suffix sorting", print_timings);
 
-    remaining_documents.push_back(std::make_pair(start, end - start));
+    for (size_t i = old_text_size; i < text_size; ++i) {
+      if (IsSuffixStart(text, i)) added.emplace_back(i);
+    }
 
-    start = end + 1;
+    std::sort(added.begin(), added.end(), less);
   }
 
-  for (auto j = features_.begin();
-       j != features_.end() && !remaining_documents.empty(); ++j) {
-    const char* string_begin = j->substring.data();
-    size_t string_length = j->substring.size();
+  PhaseTimer timer("Suffix merging", print_timings);
 
-    std::list<std::pair<const char*, size_t>>::iterator k;
-    int hits = 0;
+  // Suffixes are never equal, so each new suffix has a unique position.
+  std::vector<size_t> positions(added.size());
 
-    for (k = remaining_documents.begin(); k != remaining_documents.end();) {
-      if (memmem(k->first, k->second, string_begin, string_length)) {
-        k = remaining_documents.erase(k);
+#pragma omp parallel for
+  for (size_t i = 0; i < added.size(); ++i) {
+    positions[i] =
+        std::lower_bound(kept.begin(), kept.end(), added[i], less) -
+        kept.begin();
+  }
 
-        ++hits;
-      } else
-        ++k;
+  // The old shared prefix lengths have all been copied, so their storage can
+  // be reused.
+  suffixes.clear();
+  suffixes.reserve(kept.size() + added.size());
+  shared_prefixes_storage_.resize(kept.size() + added.size());
+  shared_prefix_overflow_storage_.clear();
+
+  // Index in `kept` of the last suffix copied, or SIZE_MAX if it was new.
+  size_t previous_kept = SIZE_MAX;
+
+  const auto append = [&](Index suffix, size_t kept_index) {
+    if (!suffixes.empty()) {
+      if (kept_index != SIZE_MAX && previous_kept + 1 == kept_index) {
+        StoreSharedPrefix(suffixes.size() - 1,
+                          kept_shared_prefixes[previous_kept]);
+      } else {
+        StoreSharedPrefix(suffixes.size() - 1,
+                          CommonPrefixLength(text, text_size, suffixes.back(),
+                                             suffix, max_shared_prefix));
+      }
     }
 
-    if (hits > cover_threshold)
-      output(hits, 0, j->log_odds, ev::StringRef(string_begin, string_length));
+    suffixes.emplace_back(suffix);
+    previous_kept = kept_index;
+  };
+
+  for (size_t i = 0, k = 0; i <= added.size(); ++i) {
+    const auto position = (i < added.size()) ? positions[i] : kept.size();
+
+    for (; k < position; ++k) append(kept[k], k);
+
+    if (i < added.size()) append(added[i], SIZE_MAX);
   }
+
+  if (!suffixes.empty()) StoreSharedPrefix(suffixes.size() - 1, 0);
 }
 
-void CommonSubstringFinder::FindDocumentBounds(const char* text,
-                                               size_t text_size) {
-  const char* text_end = text + text_size;
-  const char* ch, *next;
+void CommonSubstringFinder::AppendDocuments(const char* data, size_t size) {
+  if (!have_index_) BuildIndex();
 
-  document_starts_.emplace_back(0);
-  ch = text;
+  SetThreadCount(threads);
 
-  while (ch != text_end) {
-    if (!(next = (const char*)memchr(ch, kDocumentDelimiter, text_end - ch)))
-      next = text_end;
+  if (!size) return;
 
-    document_starts_.emplace_back(next - text);
+  const auto old_text_size = input0_size + input1_size + 1;
 
-    if (next < input1)
-      ++input0_doc_count_;
-    else
+  // The new documents are separated from the existing ones, unless the second
+  // input was empty.
+  const size_t separator = input1_size ? 1 : 0;
+
+  std::vector<char> buffer;
+  buffer.reserve(old_text_size + separator + size);
+  buffer.insert(buffer.end(), input0, input0 + old_text_size);
+  if (separator) buffer.emplace_back(kDocumentDelimiter);
+  buffer.insert(buffer.end(), data, data + size);
+
+  {
+    PhaseTimer timer("N-gram counting", print_timings);
+
+    const auto n_gram_counts = CountNGrams(data, size);
+
+    if (input1_n_gram_counts_.size() < n_gram_counts.size())
+      input1_n_gram_counts_.resize(n_gram_counts.size());
+
+    for (size_t i = 0; i < n_gram_counts.size(); ++i)
+      input1_n_gram_counts_[i] += n_gram_counts[i];
+  }
+
+  {
+    PhaseTimer timer("Document bounds", print_timings);
+
+    std::vector<size_t> document_starts(document_starts_,
+                                        document_starts_ + document_count_);
+
+    // FindDocumentBounds() drops the end of the text, which now starts the
+    // first new document.
+    document_starts.emplace_back(separator ? old_text_size : input0_size);
+
+    const char* text_end = buffer.data() + buffer.size();
+    const char* ch = buffer.data() + old_text_size + separator, *next;
+
+    while (ch != text_end) {
+      if (!(next = (const char*)memchr(ch, kDocumentDelimiter, text_end - ch)))
+        next = text_end;
+
+      document_starts.emplace_back(next - buffer.data());
       ++input1_doc_count_;
 
-    if (next == text_end) break;
+      if (next == text_end) break;
 
-    ch = next + 1;
+      ch = next + 1;
+    }
+
+    document_starts.pop_back();
+
+    document_starts_storage_.swap(document_starts);
+    SetDocumentStarts(document_starts_storage_.data(),
+                      document_starts_storage_.size());
   }
 
-  if (document_starts_.size() > 1) document_starts_.pop_back();
+  buffer_.swap(buffer);
+  input0 = buffer_.data();
+  input1 = input0 + input0_size + 1;
+  input1_size += separator + size;
 
-  const auto size = document_starts_.size();
-  document_binsearch_count_ = std::ceil(std::log2(size)) - 1;
-  document_binsearch_first_mid_ =
-      std::pow(2.0, std::ceil(std::log2(document_starts_.size())) - 1.0);
+  const auto text_size = input0_size + input1_size + 1;
+
+  if (wide_suffixes_ || use_64bit_offsets ||
+      text_size > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+    std::vector<int64_t> suffixes;
+
+    if (wide_suffixes_) {
+      MergeSuffixes(Suffixes<int64_t>(), old_text_size, suffixes);
+    } else {
+      const std::vector<int64_t> old_suffixes(
+          Suffixes<int32_t>(), Suffixes<int32_t>() + suffix_count_);
+      MergeSuffixes(old_suffixes.data(), old_text_size, suffixes);
+    }
+
+    suffixes64_.swap(suffixes);
+    suffixes32_.clear();
+    suffixes_ = suffixes64_.data();
+    suffix_count_ = suffixes64_.size();
+    wide_suffixes_ = true;
+  } else {
+    std::vector<int32_t> suffixes;
+    MergeSuffixes(Suffixes<int32_t>(), old_text_size, suffixes);
+
+    suffixes32_.swap(suffixes);
+    suffixes_ = suffixes32_.data();
+    suffix_count_ = suffixes32_.size();
+  }
+
+  FinishSharedPrefixes();
 }
 
-size_t CommonSubstringFinder::FilterSuffixes(saidx_t* input, const char* text,
-                                             size_t count) {
-  auto end = input + count;
+FILE* CommonSubstringFinder::CreateTemporaryFile(std::string& path) const {
+  const char* dir = temp_dir;
+  if (!dir) dir = getenv("TMPDIR");
+  if (!dir) dir = "/tmp";
 
-  auto output = input;
+  path = std::string(dir) + "/substring-frequencies.XXXXXX";
 
-  for (auto i = input; i != end; ++i) {
-    if (do_color && (*i & 1)) continue;
+  int fd;
+  if (-1 == (fd = mkstemp(&path[0])))
+    err(EX_CANTCREAT, "Could not create temporary file in '%s'", dir);
+
+  FILE* result;
+  if (!(result = fdopen(fd, "w+")))
+    err(EX_OSERR, "fdopen failed for '%s'", path.c_str());
+
+  return result;
+}
 
-    auto ch = static_cast<unsigned char>(text[*i]);
+const void* CommonSubstringFinder::MapTemporaryFile(FILE* file,
+                                                    const std::string& path) {
+  if (fflush(file)) err(EX_IOERR, "Write to '%s' failed", path.c_str());
 
-    if (ch == kDocumentDelimiter) continue;
+  const auto size = ftello(file);
 
-    // Skip UTF-8 continuation bytes; we're not interested in substrings
-    // starting inside characters.
-    if ((ch & 0xc0) == 0x80) continue;
+  void* map = nullptr;
 
-    *output++ = *i;
+  if (size > 0) {
+    map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (map == MAP_FAILED)
+      err(EX_IOERR, "Could not memory-map '%s'", path.c_str());
+
+    mappings_.emplace_back(map, size);
   }
 
-  return output - input;
+  // The data remains available through the mapping.
+  unlink(path.c_str());
+  fclose(file);
+
+  return map;
 }
 
-void CommonSubstringFinder::FindSubstringFrequencies() {
+void CommonSubstringFinder::BuildIndex() {
+  SetThreadCount(threads);
+
+  max_suffix_size_ = max_length;
+
   if (input1 != input0 + input0_size + 1 ||
       input0[input0_size] != kDocumentDelimiter) {
     buffer_.resize(input0_size + input1_size + 1);
@@ -437,27 +2600,51 @@ void CommonSubstringFinder::FindSubstringFrequencies() {
     input1 = &buffer_[input0_size + 1];
   }
 
-  suffixes_.resize(input0_size + input1_size + 1);
+  const auto text_size = input0_size + input1_size + 1;
 
-  if (do_probability || threshold) {
+  {
+    PhaseTimer timer("N-gram counting", print_timings);
     input0_n_gram_counts_ = CountNGrams(input0, input0_size);
     input1_n_gram_counts_ = CountNGrams(input1, input1_size);
   }
 
-  if (do_document) {
-    FindDocumentBounds(input0, input0_size + input1_size + 1);
+  {
+    PhaseTimer timer("Document bounds", print_timings);
+    FindDocumentBounds(input0, text_size);
   }
 
-  divsufsort(reinterpret_cast<const sauchar_t*>(input0), &suffixes_[0],
-             input0_size + input1_size + 1);
+  // divsufsort uses signed offsets, so 32-bit offsets cover up to 2 GiB.
+  wide_suffixes_ =
+      use_64bit_offsets ||
+      text_size > static_cast<size_t>(std::numeric_limits<int32_t>::max());
+
+  if (wide_suffixes_)
+    BuildArrays(suffixes64_);
+  else
+    BuildArrays(suffixes32_);
 
-  suffixes_.resize(
-      FilterSuffixes(&suffixes_[0], input0, input0_size + input1_size + 1));
+  have_index_ = true;
+}
+
+void CommonSubstringFinder::FindSubstringFrequencies() {
+  SetThreadCount(threads);
+
+  if (!have_index_) BuildIndex();
 
-  FindSubstrings();
+  if (suffix_count_) {
+    if (wide_suffixes_)
+      FindSubstrings(Suffixes<int64_t>());
+    else
+      FindSubstrings(Suffixes<int32_t>());
+  }
+
+  PhaseTimer timer("Output", print_timings);
 
   if (do_cover) {
-    FindCover();
+    if (wide_suffixes_)
+      FindCover(Suffixes<int64_t>());
+    else
+      FindCover(Suffixes<int32_t>());
   } else {
     for (const auto& feature : features_) {
       output(feature.input0_hits, feature.input1_hits, feature.log_odds,
@@ -4,18 +4,77 @@
 #include <climits>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <functional>
-#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "base/stringref.h"
-#include "libdivsufsort/divsufsort.h"
+#include "eytzinger.h"
+
+// Algorithms for building the suffix array.
+enum class SuffixArrayEngine {
+  // Chooses one of the engines below from the size and byte statistics of
+  // the input.
+  kAuto,
+
+  // Sorts all suffixes with libdivsufsort, then discards the suffixes that
+  // can't start a substring.
+  kDivSufSort,
+
+  // Like kDivSufSort, but sorts with the in-tree SA-IS implementation.
+  kInducedSort,
+
+  // Sorts only the suffixes that can start a substring (i.e. those kept by
+  // FilterSuffixes()).  Uses less memory and time when many suffixes are
+  // filtered, but comparison sorting is slow on highly repetitive input.
+  kSparse,
+
+  // Like kSparse, but suffixes are only sorted by as many bytes as are
+  // needed to find substrings up to the maximum length, and the suffixes that
+  // are still tied are ordered by offset.
+  kBounded,
+};
+
+// Algorithms for enumerating the repeated substrings in the suffix array.
+enum class EnumerationEngine {
+  // For every suffix array entry that starts a run of longer shared
+  // prefixes, scans forward once for every prefix length.  Superlinear on
+  // highly repetitive input.
+  kScan,
+
+  // Visits every LCP interval once in a bottom-up traversal with a stack,
+  // in time linear in the size of the suffix array.  Gives the same output
+  // as kScan for valid UTF-8 input.
+  kIntervals,
+};
 
 class CommonSubstringFinder {
  public:
+  ~CommonSubstringFinder();
+
   void FindSubstringFrequencies();
 
+  // Writes the suffix array, LCP array, document boundaries, n-gram counts
+  // and the input text to a file that can later be passed to LoadIndex().
+  // Builds the index first, if necessary.
+  void SaveIndex(const char* path);
+
+  // Memory maps an index file written by SaveIndex(), and uses it instead of
+  // `input0` and `input1`.  The mapping is read-only and shared, so processes
+  // loading the same index share its pages.
+  void LoadIndex(const char* path);
+
+  // Appends the NUL-delimited documents in `data` to the second input, and
+  // merges their suffixes into the index.  Only the new suffixes are sorted,
+  // so this is much faster than rebuilding the index when `size` is small
+  // compared to the existing input.  Builds the index first, if necessary.
+  void AppendDocuments(const char* data, size_t size);
+
   std::function<void(size_t input0_count, size_t input1_count, double log_odds,
                      const ev::StringRef& substring)> output;
 
@@ -27,10 +86,31 @@ class CommonSubstringFinder {
   int do_document = 0;
   int do_color = 0;
   int do_cover = 0;
+
+  // If set, only whole words and sequences of words are reported.  Words are
+  // separated by whitespace and other control characters, and only suffixes
+  // that start a word are added to the suffix array.
   int do_words = 0;
 
+  // If set, only maximal repeats are reported: substrings that can't be
+  // extended by a character (or with `do_words`, a word) on either side
+  // without losing occurrences, or without exceeding `max_length`.
+  int do_maximal = 0;
+
   int filter_redundant_features = 1;
 
+  // Only substrings of at least `min_length` and at most `max_length` bytes
+  // are reported.  In color mode, each character takes two bytes.  Suffixes
+  // are compared no deeper than `max_length` bytes when building the index,
+  // and an index can't be loaded with a larger `max_length` than it was built
+  // with.
+  size_t min_length = 1;
+  size_t max_length = 32;
+
+  // Largest supported `max_length`.  Shared prefix lengths up to
+  // `max_length` + 1 are stored in one byte each.
+  static const size_t kMaxLength = 253;
+
   double prior_bias = 1.0;
   double threshold = 0.0;
   int cover_threshold = 0;
@@ -43,10 +123,49 @@ class CommonSubstringFinder {
   // isn't used.
   int threshold_count = -1;
 
+  // If non-zero, only the `top_k` substrings with the largest absolute log
+  // odds for each input are kept, before redundant features are filtered.
+  // Ties are broken in favor of the substring found first.
+  size_t top_k = 0;
+
   // If set to false, does not produce two substrings corresponding to the same
   // set of document.
   int allow_equal_sets = 1;
 
+  // If positive, redundant features are filtered further by keeping only the
+  // most predictive of features whose document sets have at least this
+  // Jaccard similarity, as estimated from MinHash signatures.  Only used in
+  // document mode.
+  double jaccard_threshold = 0.0;
+
+  // If set, uses 64-bit suffix array offsets even if the input is small enough
+  // for 32-bit offsets.  Inputs larger than 2 GiB always use 64-bit offsets.
+  int use_64bit_offsets = 0;
+
+  // Number of threads to use for suffix sorting and substring enumeration.
+  // If zero, uses the OpenMP default, which is usually the number of
+  // available cores.
+  int threads = 0;
+
+  // If non-zero, and building the suffix array in memory would need more than
+  // this many bytes, the suffix array and LCP array are instead built in
+  // passes, each sorting only as many suffixes as fit in this limit, and
+  // stored in temporary files.
+  size_t memory_limit = 0;
+
+  // Algorithm used to build the suffix array in memory.
+  SuffixArrayEngine sa_engine = SuffixArrayEngine::kDivSufSort;
+
+  // Algorithm used to enumerate substrings.
+  EnumerationEngine enumeration_engine = EnumerationEngine::kIntervals;
+
+  // Directory for temporary files.  If null, uses $TMPDIR, or /tmp.
+  const char* temp_dir = nullptr;
+
+  // If set, prints the wall-clock and CPU time of each processing phase to
+  // standard error.
+  int print_timings = 0;
+
  private:
   struct Feature {
     Feature(const ev::StringRef& substring, float log_odds, size_t input0_hits,
@@ -61,6 +180,9 @@ class CommonSubstringFinder {
     float log_odds;
     size_t input0_hits;
     size_t input1_hits;
+
+    // With `jaccard_threshold`, the MinHash signature of the document set.
+    std::vector<uint32_t> min_hashes;
   };
 
   struct CompareLength {
@@ -78,52 +200,496 @@ class CommonSubstringFinder {
     }
   };
 
-  void AddSuffix(const ev::StringRef& suffix, const saidx_t* offsets,
-                 size_t count, size_t input0_threshold,
-                 size_t input1_threshold);
+  // A substring that passed the count and probability thresholds, but has
+  // not yet been compared against the other features.
+  struct Candidate {
+    ev::StringRef substring;
+    double log_odds;
+    size_t input0_hits;
+    size_t input1_hits;
+    uint64_t set_hash;
+    std::vector<uint32_t> min_hashes;
+  };
+
+  // MinHash signatures have one minimum hash for each of this many bins of
+  // document hashes, or UINT32_MAX for bins with no documents.  Similar
+  // signatures are found by indexing them in bands of kMinHashRows bins.
+  static const size_t kMinHashBins = 16;
+  static const size_t kMinHashRows = 4;
+
+  // Set of documents used by AddSuffix() to count the documents of a
+  // substring, reused across calls by one thread.  Only the words that were
+  // set are cleared afterwards, so small intervals cost time proportional to
+  // their size rather than to the number of documents.
+  struct DocumentSet {
+    // One bit per document, allocated on first use.
+    std::vector<uint32_t> bits;
+
+    // Indexes of the non-zero words in `bits`.
+    std::vector<size_t> words;
+  };
 
-  void BuildLCPArray(std::vector<size_t>& result, const char* text,
-                     size_t text_length, const saidx_t* suffixes,
-                     size_t suffix_count);
+  // A candidate kept for `top_k`, with its position in the order the serial
+  // algorithm finds candidates.
+  struct RankedCandidate {
+    Candidate candidate;
+    size_t chunk;
+    size_t index;
+  };
 
-  void FindSubstrings();
+  // Returns true if `lhs` ranks before `rhs` for `top_k`: it has a larger
+  // absolute log odds, or is found first.
+  static bool RanksBefore(const RankedCandidate& lhs,
+                          const RankedCandidate& rhs);
+
+  // State used by one thread during substring enumeration.
+  struct ThreadState {
+    DocumentSet documents;
+
+    // With `top_k`, the best candidates for input0 (positive log odds) and
+    // input1 found by this thread, as heaps with the lowest ranked first.
+    std::vector<RankedCandidate> top[2];
+
+    // With `top_k`, candidates for input0 and input1 whose absolute log odds
+    // are below these can't be among the best candidates.  Raised as `top`
+    // fills up.
+    double min_log_odds[2] = {0.0, 0.0};
+  };
+
+  // Moves the candidates of chunk `chunk` into the heaps in `state`,
+  // keeping at most `top_k` for each input, and updates its log odds bounds.
+  void AddTopCandidates(size_t chunk, std::vector<Candidate>& candidates,
+                        ThreadState& state) const;
+
+  // Adds the best `top_k` candidates for each input in `states` as features,
+  // in the order the serial algorithm finds them.
+  void AddTopFeatures(std::vector<ThreadState>& states);
+
+  // Finds the substrings starting in suffix array entries [begin, end), and
+  // appends those that pass the thresholds to `candidates`, in the order the
+  // serial algorithm finds them.
+  template <typename Index>
+  void FindSubstringsInRange(const Index* suffixes, size_t begin, size_t end,
+                             size_t input0_threshold, size_t input1_threshold,
+                             ThreadState& state,
+                             std::vector<Candidate>& candidates) const;
+
+  // Per-chunk data that lets FindIntervalsInChunk() follow intervals into
+  // the following chunks without visiting all of their entries.
+  struct ChunkSummaries {
+    // First entry of each chunk, as passed to FindSubstringsInRange(), and
+    // the end of the suffix array.
+    std::vector<size_t> starts;
+
+    // Smallest shared prefix and offset of the entries in each chunk.
+    std::vector<uint8_t> min_prefixes;
+    std::vector<size_t> min_offsets;
+
+    // When counting documents, the number of entries in each chunk from
+    // input0 and input1 for each value of `document_shared_prefixes_`.
+    std::vector<uint32_t> duplicate_counts;
+
+    // With `do_maximal`, the left context shared by the entries in each
+    // chunk.
+    std::vector<uint32_t> left_contexts;
+  };
+
+  // Number of suffix array entries in each of the blocks summarized for
+  // skipping intervals that can't pass the thresholds.
+  static const size_t kBlockSize = 256;
+
+  // Fills the summaries in `chunks` for the chunks given by `chunks.starts`.
+  // If `blocks` is not null, it summarizes blocks of kBlockSize entries, and
+  // is used for the whole blocks in each chunk.
+  template <typename Index>
+  void SummarizeChunks(const Index* suffixes, bool count_documents,
+                       const ChunkSummaries* blocks,
+                       ChunkSummaries& chunks) const;
+
+  // Like FindSubstringsInRange(), but visits the LCP intervals whose left
+  // boundary is in chunk `chunk` bottom-up.  Intervals that extend past the
+  // end of the chunk are followed into the next chunks, skipping the chunks
+  // in which none of them end.  If `blocks` summarizes blocks of
+  // kBlockSize entries, intervals whose substrings can't pass the thresholds
+  // are skipped along with all the intervals inside them.
+  template <typename Index>
+  void FindIntervalsInChunk(const Index* suffixes,
+                            const ChunkSummaries& chunks,
+                            const ChunkSummaries& blocks, size_t chunk,
+                            size_t input0_threshold, size_t input1_threshold,
+                            ThreadState& state,
+                            std::vector<Candidate>& candidates) const;
+
+  // Fills `min_prior_odds_` and `max_prior_odds_`.
+  void BuildPriorOdds();
+
+  // Returns false if no substring of at least `length` bytes that occurs
+  // in at most `input0_count` and `input1_count` entries or documents of
+  // each input can pass the count and probability thresholds.  Extending a
+  // substring never adds occurrences, so this holds for all its extensions
+  // too.
+  bool MayPassThresholds(size_t input0_count, size_t input1_count,
+                         size_t length, size_t input0_threshold,
+                         size_t input1_threshold,
+                         const ThreadState& state) const;
+
+  // Returns the start of the chunk of suffix array entries that begins at or
+  // shortly after `index`.  Chunks start where the shared prefix with the
+  // previous entry is shallowest, preferably zero.
+  size_t ChunkStart(size_t index, size_t max_distance) const;
+
+  // Scores the substring that starts the `count` suffixes beginning at
+  // suffix array entry `first`, and appends it to `candidates` if it passes
+  // the thresholds.  In document mode, `document_hits` may give the number of
+  // input0 and input1 documents the substring occurs in; otherwise these are
+  // found from the offsets, using `state.documents`.  Likewise, with
+  // `do_maximal`, `left_context` may give the left context shared by all the
+  // suffixes.
+  template <typename Index>
+  void AddSuffix(const ev::StringRef& suffix, const Index* suffixes,
+                 size_t first, size_t count, const size_t* document_hits,
+                 const uint32_t* left_context,
+                 size_t input0_threshold, size_t input1_threshold,
+                 ThreadState& state,
+                 std::vector<Candidate>& candidates) const;
+
+  // Fills `document_hash_keys_` and `document_hash_base_`.
+  void BuildDocumentHashKeys();
+
+  // Builds `document_shared_prefixes_` for `suffixes`.
+  template <typename Index>
+  void BuildDocumentSharedPrefixes(const Index* suffixes);
+
+  // Builds `input0_ranks_` for `suffixes`.
+  template <typename Index>
+  void BuildInput0Ranks(const Index* suffixes);
+
+  // Returns the number of suffix array entries before `index` whose suffix
+  // starts in input0.
+  size_t Input0Rank(size_t index) const;
+
+  // Adds a candidate to `features_`, replacing a redundant existing feature,
+  // or prints it right away when no features need to be kept.
+  void AddFeature(const Candidate& candidate);
+
+  // Orders feature suffixes by their bytes, so that those that start with a
+  // given string are adjacent, and then by feature.
+  struct SuffixOrder {
+    bool operator()(const std::pair<ev::StringRef, size_t>& lhs,
+                    const std::pair<ev::StringRef, size_t>& rhs) const {
+      const auto cmp = lhs.first.compare(rhs.first);
+      return cmp ? (cmp < 0) : (lhs.second < rhs.second);
+    }
+  };
+
+  // Indexes of the features with positive or other log odds, for finding
+  // the features that are redundant with a candidate without comparing it
+  // to all of them.
+  struct FeatureIndex {
+    // Features by the hash of their substring.
+    std::unordered_map<uint64_t, std::vector<size_t>> substrings;
+
+    // Bit `hash >> (64 - kFilterBits)` is set for the hash of every substring
+    // in `substrings`, so that most other hashes need no lookup.  Not
+    // cleared when features are removed.
+    static const size_t kFilterBits = 16;
+    std::vector<uint64_t> filter;
+
+    // Every suffix of every feature.  The features that contain a string
+    // are those with a suffix that starts with it.
+    std::set<std::pair<ev::StringRef, size_t>, SuffixOrder> suffixes;
+
+    // Number of features of each length.
+    std::vector<size_t> length_counts;
+
+    // Without `allow_equal_sets`, features by their document set hash.
+    std::unordered_map<uint64_t, std::set<size_t>> set_hashes;
+
+    // In RemoveSimilarFeatures(), the features kept so far by the hash of
+    // each band of their MinHash signature.  Features with similar document
+    // sets likely share a band.
+    std::unordered_map<uint64_t, std::vector<size_t>> bands;
+  };
+
+  // Adds feature `index` to `feature_indexes_`, or removes it.
+  void IndexFeature(size_t index, bool add);
+
+  // Returns the index of the first feature with positive log odds, or other
+  // log odds if `positive` is false, whose substring contains or is
+  // contained in `substring`, or features_.size() if there is none.
+  size_t FindRedundantFeature(const ev::StringRef& substring,
+                              bool positive) const;
+
+  // Like FindRedundantFeature(), but returns the first feature whose
+  // MinHash signature shares a band with `min_hashes`, and gives an
+  // estimated Jaccard similarity of at least `jaccard_threshold`.
+  size_t FindSimilarFeature(const std::vector<uint32_t>& min_hashes,
+                            bool positive) const;
+
+  // Removes each feature whose document set is similar to that of a more
+  // predictive feature with the same sign.
+  void RemoveSimilarFeatures();
+
+  // Builds the LCP array of `suffixes` in `shared_prefixes_storage_`, capped
+  // at max_suffix_size_ + 1.  Shared prefix lengths are computed in text
+  // order from the previous one (the permuted LCP array), one segment of the
+  // text at a time, so only about one byte per byte of text is needed in
+  // addition to the output.
+  template <typename Index>
+  void BuildLCPArray(const Index* suffixes, size_t suffix_count);
+
+  // Concatenates the inputs if necessary, and builds all the data structures
+  // used by FindSubstrings().
+  void BuildIndex();
+
+  // Builds the suffix array and LCP array, in memory or externally depending
+  // on `memory_limit`.  `Index` is either int32_t or int64_t, depending on the
+  // size of the input.
+  template <typename Index>
+  void BuildArrays(std::vector<Index>& suffixes);
+
+  // Returns the engine to use for SuffixArrayEngine::kAuto.
+  SuffixArrayEngine ChooseSuffixArrayEngine() const;
+
+  // Sorts and filters the suffixes of the concatenated input, and builds the
+  // LCP array, all in memory.  `engine` is either kDivSufSort or
+  // kInducedSort.
+  template <typename Index>
+  void BuildSuffixArray(std::vector<Index>& suffixes,
+                        SuffixArrayEngine engine);
+
+  // Sorts only the suffixes accepted by IsSuffixStart(), and builds a capped
+  // LCP array by comparing adjacent suffixes.  If `max_depth` is non-zero,
+  // suffixes are only sorted by their first `max_depth` bytes.
+  template <typename Index>
+  void BuildSparseSuffixArray(std::vector<Index>& suffixes, size_t max_depth);
+
+  // Suffixes are partitioned into buckets on their first two bytes.  The
+  // second byte is offset by one, so that the last suffix of the text, which
+  // is only one byte long, sorts before the longer suffixes starting with the
+  // same byte.
+  static const size_t kSuffixBucketCount = 256 * 257;
+
+  size_t SuffixBucket(size_t offset) const;
+
+  // Returns the number of suffixes accepted by IsSuffixStart() in each bucket.
+  std::vector<size_t> CountSuffixBuckets() const;
+
+  // Stores the sorted offsets of the suffixes accepted by IsSuffixStart() in
+  // buckets `first_bucket` through `last_bucket - 1` in `output`.  If
+  // `max_depth` is non-zero, suffixes are only sorted by their first
+  // `max_depth` bytes, up to the first document delimiter.
+  template <typename Index>
+  void SortSuffixBuckets(const std::vector<size_t>& bucket_sizes,
+                         size_t first_bucket, size_t last_bucket,
+                         size_t max_depth, Index* output) const;
+
+  // Builds the suffix array and LCP array in temporary files, holding at most
+  // `memory_limit` bytes of suffixes in memory at a time.  Suffixes are
+  // partitioned by their first two bytes, and each pass reads the text and
+  // sorts the suffixes of a range of partitions.  The LCP array is capped at
+  // max_suffix_size_ + 1.
+  template <typename Index>
+  void BuildSuffixArrayExternal();
+
+  // Merges the suffixes of the text starting at or after `old_text_size` with
+  // `old_suffixes`, the suffix array of the text before that offset, and
+  // stores the result in `suffixes` and `shared_prefixes_storage_`.
+  template <typename Index>
+  void MergeSuffixes(const Index* old_suffixes, size_t old_text_size,
+                     std::vector<Index>& suffixes);
+
+  // Creates a temporary file in `temp_dir`, and stores its name in `path`.
+  FILE* CreateTemporaryFile(std::string& path) const;
+
+  // Maps a temporary file created by CreateTemporaryFile() read-only, then
+  // closes and deletes it.  The mapping is released in the destructor.
+  const void* MapTemporaryFile(FILE* file, const std::string& path);
+
+  template <typename Index>
+  void FindSubstrings(const Index* suffixes);
+
+  template <typename Index>
+  const Index* Suffixes() const {
+    return reinterpret_cast<const Index*>(suffixes_);
+  }
+
+  // Returns the length of the prefix shared by the suffixes at index `index`
+  // and `index + 1` of the suffix array, capped at max_suffix_size_ + 1.
+  size_t SharedPrefix(size_t index) const {
+    const size_t result = shared_prefixes_[index];
+    if (result != kSharedPrefixOverflow) return result;
+    return SharedPrefixOverflow(index);
+  }
+
+  size_t SharedPrefixOverflow(size_t index) const;
+
+  // Stores the shared prefix length at `index` in `shared_prefixes_storage_`,
+  // adding it to `shared_prefix_overflow_storage_` if it doesn't fit in a
+  // byte.  May be called from several threads for different indexes.
+  void StoreSharedPrefix(size_t index, size_t length);
+
+  // Sorts `shared_prefix_overflow_storage_`, and uses the storage vectors for
+  // SharedPrefix().
+  void FinishSharedPrefixes();
+
+  void SetSharedPrefixes(const uint8_t* shared_prefixes,
+                         const std::pair<uint64_t, uint64_t>* overflow,
+                         size_t overflow_count);
+
+  // Copies the shared prefix lengths to `shared_prefixes_storage_`, capped at
+  // max_suffix_size_ + 1.  Used for indexes built with a larger maximum
+  // length.
+  void CapSharedPrefixes();
+
+  // Sets `document_starts_` and the search structure derived from it.
+  void SetDocumentStarts(const size_t* document_starts, size_t count);
 
   std::vector<size_t> CountNGrams(const char* text, size_t text_size);
 
-  void FindCover(void);
+  // Outputs a greedy cover of the documents of `input0` by `features_`.  Each
+  // feature's documents are found from its suffix array interval.
+  template <typename Index>
+  void FindCover(const Index* suffixes);
 
   void OutputUnique();
 
   void FindDocumentBounds(const char* text, size_t text_size);
 
-  size_t FilterSuffixes(saidx_t* input, const char* text, size_t count);
+  template <typename Index>
+  size_t FilterSuffixes(Index* input, const char* text, size_t count);
 
-  // Returns the document index corresponding to a given offset in the input.
-  size_t DocIdxForOffset(saidx_t offset) const;
+  // Returns true if the suffix starting at the given offset should be part of
+  // the suffix array.
+  bool IsSuffixStart(const char* text, size_t offset) const;
+
+  // Returns a hash of what precedes the suffix at `offset` in the text: the
+  // previous character, or with `do_words` the previous word and the
+  // separators after it.  If `length` is non-null, stores the length of that
+  // context in it.  Returns kMixedLeftContext if the suffix starts its
+  // document.
+  uint32_t LeftContext(size_t offset, size_t* length = nullptr) const;
+
+  // Builds `left_contexts_` for `suffixes`.
+  template <typename Index>
+  void BuildLeftContexts(const Index* suffixes);
 
-  std::mutex output_mutex_;
+  // Returns true if the suffixes at offsets `lhs` and `rhs`, which share
+  // their first `length` bytes, also share the next character, or with
+  // `do_words` the next word, within the maximum substring length.
+  bool SharesNextUnit(size_t lhs, size_t rhs, size_t length) const;
+
+  // Returns the document index corresponding to a given offset in the input.
+  size_t DocIdxForOffset(size_t offset) const {
+    const auto count = document_search_.CountLess(offset);
+    return count ? count - 1 : 0;
+  }
+
+  // Returns the document of the suffix in suffix array entry `index`, which
+  // starts at `offset`.
+  size_t SuffixDocument(size_t index, size_t offset) const {
+    return suffix_documents_.empty() ? DocIdxForOffset(offset)
+                                     : suffix_documents_[index];
+  }
+
+  // Builds `suffix_documents_` for `suffixes`, if it fits in the memory
+  // limit.
+  template <typename Index>
+  void BuildSuffixDocuments(const Index* suffixes);
 
   std::vector<char> buffer_;
 
-  std::vector<saidx_t> suffixes_;
+  // Set once the arrays below are ready, either by BuildIndex() or by
+  // LoadIndex().
+  bool have_index_ = false;
+
+  // The suffix array, LCP array and document start array point either into
+  // the storage vectors below, or into the memory mapped index file.
+  const void* suffixes_ = nullptr;
+  size_t suffix_count_ = 0;
+  bool wide_suffixes_ = false;
+
+  // Shared prefix lengths are stored in one byte each.  Lengths that don't
+  // fit are stored as kSharedPrefixOverflow, with (index, length) pairs in
+  // `shared_prefix_overflow_`.  Since lengths are capped at
+  // max_suffix_size_ + 1, this only happens for very long substrings.
+  static const uint8_t kSharedPrefixOverflow = 255;
+
+  const uint8_t* shared_prefixes_ = nullptr;
+  const std::pair<uint64_t, uint64_t>* shared_prefix_overflow_ = nullptr;
+  size_t shared_prefix_overflow_count_ = 0;
+
+  const size_t* document_starts_ = nullptr;
+  size_t document_count_ = 0;
+
+  // Only one of these is used, depending on whether 64-bit offsets are needed.
+  std::vector<int32_t> suffixes32_;
+  std::vector<int64_t> suffixes64_;
+
+  std::vector<uint8_t> shared_prefixes_storage_;
+  std::vector<std::pair<uint64_t, uint64_t>> shared_prefix_overflow_storage_;
+
+  std::vector<size_t> document_starts_storage_;
+
+  // Memory mappings released in the destructor.
+  std::vector<std::pair<void*, size_t>> mappings_;
+
+  // Bit i of `bits` is set if the suffix in suffix array entry 64 * k + i,
+  // where k is the index of the block, starts in input0.  `rank` is the
+  // number of set bits in the preceding blocks.
+  struct RankBlock {
+    uint64_t rank;
+    uint64_t bits;
+  };
+
+  std::vector<RankBlock> input0_ranks_;
+
+  // Random keys for each 32-document word of a document set, combined into
+  // the set hashes that detect equal document sets.  `document_hash_base_`
+  // is the hash of the empty set, i.e. the sum of the keys.
+  std::vector<uint64_t> document_hash_keys_;
+  uint64_t document_hash_base_ = 0;
+
+  // For each suffix array entry, the length of the prefix it shares with the
+  // closest preceding entry from the same document, capped like the LCP
+  // array, or 0 if there is none.  Only built for the interval engine in
+  // document mode.
+  std::vector<uint8_t> document_shared_prefixes_;
 
   std::vector<size_t> input0_n_gram_counts_;
   std::vector<size_t> input1_n_gram_counts_;
 
-  std::vector<saidx_t> document_starts_;
+  // `document_starts_` in Eytzinger order, for finding the document of an
+  // offset.
+  EytzingerArray document_search_;
 
-  // ceil(log2(document_starts_.size())) -- Number of iterations in binary
-  // search of document_starts_.
-  size_t document_binsearch_count_;
-  size_t document_binsearch_first_mid_;
+  // The document of each suffix array entry.  Built in document mode if it
+  // fits in `memory_limit`; otherwise documents are found with
+  // `document_search_`.
+  std::vector<uint32_t> suffix_documents_;
+
+  // With `do_maximal`, the LeftContext() of each suffix array entry; the
+  // Burrows-Wheeler transform, extended to whole characters or words.
+  std::vector<uint32_t> left_contexts_;
 
   size_t input0_doc_count_ = 0;
   size_t input1_doc_count_ = 0;
 
+  // The smallest and largest prior odds AddSuffix() uses for substrings of
+  // each length or longer, up to max_suffix_size_ + 1.
+  std::vector<double> min_prior_odds_;
+  std::vector<double> max_prior_odds_;
+
+  // Maximum length of reported substrings; `max_length` when the index was
+  // built or loaded.
   size_t max_suffix_size_ = 32;
 
   // List of suffixes collected so far.
   std::vector<Feature> features_;
+
+  // With `filter_redundant_features`, indexes of `features_` with other and
+  // positive log odds, while substrings are being found.
+  FeatureIndex feature_indexes_[2];
 };
 
 #endif  // !SUBSTRINGS_H_
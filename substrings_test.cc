@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
 #include <set>
 #include <string>
+#include <vector>
+
+#include <unistd.h>
 
 #include "substrings.h"
 
@@ -50,7 +56,29 @@ void CompareSets(const std::string& input0, const std::string& input1,
 }
 
 void TestUniqueStrings(const std::string& input0, const std::string& input1,
-                       const std::set<std::string>& expected) {
+                       const std::set<std::string>& expected,
+                       bool use_64bit_offsets = false) {
+  CommonSubstringFinder csf;
+
+  csf.input0 = input0.data();
+  csf.input0_size = input0.size();
+  csf.input1 = input1.data();
+  csf.input1_size = input1.size();
+
+  csf.threshold_count = 1;
+  csf.filter_redundant_features = 0;
+  csf.use_64bit_offsets = use_64bit_offsets;
+
+  csf.output = CollectUnique;
+
+  unique_strings.clear();
+  csf.FindSubstringFrequencies();
+
+  CompareSets(input0, input1, expected, unique_strings);
+}
+
+void TestWords(const std::string& input0, const std::string& input1,
+               const std::set<std::string>& expected) {
   CommonSubstringFinder csf;
 
   csf.input0 = input0.data();
@@ -60,6 +88,7 @@ void TestUniqueStrings(const std::string& input0, const std::string& input1,
 
   csf.threshold_count = 1;
   csf.filter_redundant_features = 0;
+  csf.do_words = 1;
 
   csf.output = CollectUnique;
 
@@ -100,6 +129,809 @@ void TestDocuments(const std::string& input0, const std::string& input1,
   CompareSets(input0, input1, expected, unique_strings);
 }
 
+// Returns random NUL-delimited documents made from a small vocabulary, so that
+// many substrings repeat.
+std::string MakeRandomDocuments(std::minstd_rand& rng,
+                                const std::vector<std::string>& vocabulary,
+                                size_t document_count) {
+  std::uniform_int_distribution<size_t> word_dist(0, vocabulary.size() - 1);
+  std::uniform_int_distribution<size_t> length_dist(1, 20);
+
+  std::string result;
+
+  for (size_t i = 0; i < document_count; ++i) {
+    if (i) result.push_back(0);
+
+    for (size_t j = length_dist(rng); j--;) {
+      result += vocabulary[word_dist(rng)];
+      if (j) result.push_back(' ');
+    }
+  }
+
+  return result;
+}
+
+// Runs the finder with the given configuration, and returns all output lines
+// in order.
+std::vector<std::string> CollectOutput(
+    const std::string& input0, const std::string& input1,
+    const std::function<void(CommonSubstringFinder&)>& configure) {
+  CommonSubstringFinder csf;
+
+  csf.input0 = input0.data();
+  csf.input0_size = input0.size();
+  csf.input1 = input1.data();
+  csf.input1_size = input1.size();
+
+  configure(csf);
+
+  std::vector<std::string> result;
+
+  csf.output = [&result](size_t input0_count, size_t input1_count,
+                         double log_odds, const ev::StringRef& string) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%.3f\t%zu\t%zu\t", log_odds,
+             input0_count, input1_count);
+    result.emplace_back(prefix + string.str());
+  };
+
+  csf.FindSubstringFrequencies();
+
+  return result;
+}
+
+void CompareOutputs(const std::vector<std::string>& expected,
+                    const std::vector<std::string>& got) {
+  if (expected == got) return;
+
+  fprintf(stderr, "Expected %zu output lines, got %zu\n", expected.size(),
+          got.size());
+
+  for (size_t i = 0; i < std::min(expected.size(), got.size()); ++i) {
+    if (expected[i] == got[i]) continue;
+    fprintf(stderr, "First difference at line %zu: \"%s\" vs \"%s\"\n", i,
+            expected[i].c_str(), got[i].c_str());
+    break;
+  }
+
+  abort();
+}
+
+// Verifies that two configurations produce identical output.
+void CompareOutputs(
+    const std::string& input0, const std::string& input1,
+    const std::function<void(CommonSubstringFinder&)>& configure_expected,
+    const std::function<void(CommonSubstringFinder&)>& configure_got) {
+  CompareOutputs(CollectOutput(input0, input1, configure_expected),
+                 CollectOutput(input0, input1, configure_got));
+}
+
+void TestThreads() {
+  // Large enough for the LCP array to be built, and the substrings to be
+  // enumerated, in several parallel chunks.
+  std::minstd_rand rng(1);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 3000);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 3000);
+
+  for (int do_document : {0, 1}) {
+    for (int threads : {2, 4}) {
+      CompareOutputs(input0, input1,
+                     [do_document](CommonSubstringFinder& csf) {
+                       csf.threads = 1;
+                       csf.do_document = do_document;
+                       csf.threshold_count = 2;
+                     },
+                     [do_document, threads](CommonSubstringFinder& csf) {
+                       csf.threads = threads;
+                       csf.do_document = do_document;
+                       csf.threshold_count = 2;
+                     });
+    }
+  }
+}
+
+void TestIndexFile(bool use_64bit_offsets) {
+  std::minstd_rand rng(2);
+  const auto input0 =
+      MakeRandomDocuments(rng, {"foo", "bar", "baz", "x", "yy"}, 300);
+  const auto input1 =
+      MakeRandomDocuments(rng, {"foo", "bar", "quux", "x", "zz"}, 300);
+
+  char path[] = "/tmp/substrings_test.XXXXXX";
+  const auto fd = mkstemp(path);
+  if (fd == -1) abort();
+  close(fd);
+
+  {
+    CommonSubstringFinder csf;
+    csf.input0 = input0.data();
+    csf.input0_size = input0.size();
+    csf.input1 = input1.data();
+    csf.input1_size = input1.size();
+    csf.use_64bit_offsets = use_64bit_offsets;
+    csf.SaveIndex(path);
+  }
+
+  for (int do_document : {0, 1}) {
+    CompareOutputs(input0, input1,
+                   [do_document](CommonSubstringFinder& csf) {
+                     csf.do_document = do_document;
+                     csf.threshold = 0.5;
+                   },
+                   [do_document, &path](CommonSubstringFinder& csf) {
+                     csf.do_document = do_document;
+                     csf.threshold = 0.5;
+                     csf.LoadIndex(path);
+                   });
+  }
+
+  unlink(path);
+}
+
+void TestMemoryLimit() {
+  std::minstd_rand rng(3);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 300);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 300);
+
+  for (int do_document : {0, 1}) {
+    for (int skip_samecount_prefixes : {0, 1}) {
+      const auto configure = [=](CommonSubstringFinder& csf) {
+        csf.do_document = do_document;
+        csf.skip_samecount_prefixes = skip_samecount_prefixes;
+        csf.threshold = 0.5;
+      };
+
+      CompareOutputs(input0, input1, configure,
+                     [&configure](CommonSubstringFinder& csf) {
+                       configure(csf);
+                       csf.memory_limit = 4096;
+                     });
+    }
+  }
+}
+
+void TestSuffixArrayEngines() {
+  std::minstd_rand rng(4);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 300);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 300);
+
+  for (int do_document : {0, 1}) {
+    for (int skip_samecount_prefixes : {0, 1}) {
+      for (int do_color : {0, 1}) {
+        for (int do_words : {0, 1}) {
+          const auto configure = [=](CommonSubstringFinder& csf) {
+            csf.do_document = do_document;
+            csf.skip_samecount_prefixes = skip_samecount_prefixes;
+            csf.do_color = do_color;
+            csf.do_words = do_words;
+            csf.threshold = 0.5;
+          };
+
+          for (auto engine :
+               {SuffixArrayEngine::kAuto, SuffixArrayEngine::kInducedSort,
+                SuffixArrayEngine::kSparse, SuffixArrayEngine::kBounded}) {
+            CompareOutputs(input0, input1, configure,
+                           [&configure, engine](CommonSubstringFinder& csf) {
+                             configure(csf);
+                             csf.sa_engine = engine;
+                           });
+          }
+        }
+      }
+    }
+  }
+}
+
+void TestEnumerationEngines() {
+  // Long runs of the same byte give LCP intervals that span many chunks.
+  const std::string run(40, 'a');
+
+  for (unsigned seed : {6, 7, 8}) {
+    std::minstd_rand rng(seed);
+    const size_t document_count = (seed == 6) ? 1000 : 100;
+    const auto input0 = MakeRandomDocuments(
+        rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", run}, document_count);
+    const auto input1 = MakeRandomDocuments(
+        rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", run},
+        document_count);
+
+    for (int do_document : {0, 1}) {
+      for (int skip_samecount_prefixes : {0, 1}) {
+        for (int do_color : {0, 1}) {
+          for (int do_words : {0, 1}) {
+            for (int filter_redundant_features : {0, 1}) {
+              const auto configure = [=](CommonSubstringFinder& csf) {
+                csf.do_document = do_document;
+                csf.skip_samecount_prefixes = skip_samecount_prefixes;
+                csf.do_color = do_color;
+                csf.do_words = do_words;
+                csf.filter_redundant_features = filter_redundant_features;
+                csf.threshold_count = 2;
+                csf.enumeration_engine = EnumerationEngine::kScan;
+              };
+
+              CompareOutputs(input0, input1, configure,
+                             [&configure](CommonSubstringFinder& csf) {
+                               configure(csf);
+                               csf.enumeration_engine =
+                                   EnumerationEngine::kIntervals;
+                             });
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void TestScoreBounds() {
+  // Skewed vocabularies give intervals that fail the thresholds in various
+  // ways, some spanning many blocks.
+  std::minstd_rand rng(11);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "qux", "h\xc3\xa9llo", "x", "yy"}, 2000);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "corge", "h\xc3\xa9llo", "x", "zz"}, 1000);
+
+  for (int do_document : {0, 1}) {
+    for (int threshold_count : {2, 100, 1000}) {
+      for (double threshold : {0.0, 1.0, 3.0}) {
+        for (size_t top_k : {0, 5}) {
+          const auto configure = [=](CommonSubstringFinder& csf) {
+            csf.do_document = do_document;
+            csf.threshold_count = threshold_count;
+            csf.threshold = threshold;
+            csf.top_k = top_k;
+            csf.enumeration_engine = EnumerationEngine::kScan;
+          };
+
+          CompareOutputs(input0, input1, configure,
+                         [&configure](CommonSubstringFinder& csf) {
+                           configure(csf);
+                           csf.enumeration_engine =
+                               EnumerationEngine::kIntervals;
+                         });
+        }
+      }
+    }
+  }
+}
+
+void TestLengthWindow() {
+  std::minstd_rand rng(9);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 300);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 300);
+
+  char path[] = "/tmp/substrings_test.XXXXXX";
+  const auto fd = mkstemp(path);
+  if (fd == -1) abort();
+  close(fd);
+
+  {
+    CommonSubstringFinder csf;
+    csf.input0 = input0.data();
+    csf.input0_size = input0.size();
+    csf.input1 = input1.data();
+    csf.input1_size = input1.size();
+    csf.SaveIndex(path);
+  }
+
+  for (int do_document : {0, 1}) {
+    for (auto engine :
+         {EnumerationEngine::kScan, EnumerationEngine::kIntervals}) {
+      const auto configure = [=](CommonSubstringFinder& csf) {
+        csf.do_document = do_document;
+        csf.filter_redundant_features = 0;
+        csf.threshold_count = 2;
+        csf.enumeration_engine = engine;
+      };
+
+      // Without filtering, the window only removes the substrings outside it.
+      std::vector<std::string> expected;
+
+      for (const auto& line : CollectOutput(input0, input1, configure)) {
+        // The substring follows the third tab.
+        size_t start = 0;
+        for (size_t i = 0; i < 3; ++i) start = line.find('\t', start) + 1;
+
+        const auto length = line.size() - start;
+        if (length >= 4 && length <= 12) expected.emplace_back(line);
+      }
+
+      const auto configure_window = [&configure](CommonSubstringFinder& csf) {
+        configure(csf);
+        csf.min_length = 4;
+        csf.max_length = 12;
+      };
+
+      CompareOutputs(expected,
+                     CollectOutput(input0, input1, configure_window));
+
+      // An index built for longer substrings gives the same output.
+      CompareOutputs(expected,
+                     CollectOutput(input0, input1,
+                                   [&configure_window,
+                                    &path](CommonSubstringFinder& csf) {
+                                     configure_window(csf);
+                                     csf.LoadIndex(path);
+                                   }));
+    }
+  }
+
+  unlink(path);
+}
+
+void TestTopK() {
+  std::minstd_rand rng(10);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 3000);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 3000);
+
+  for (int do_document : {0, 1}) {
+    const auto configure = [do_document](CommonSubstringFinder& csf) {
+      csf.do_document = do_document;
+      csf.filter_redundant_features = 0;
+      csf.threshold_count = 2;
+    };
+
+    const auto all = CollectOutput(input0, input1, configure);
+
+    // The printed log odds are rounded, so collect them separately.
+    std::vector<double> log_odds;
+
+    {
+      CommonSubstringFinder csf;
+      csf.input0 = input0.data();
+      csf.input0_size = input0.size();
+      csf.input1 = input1.data();
+      csf.input1_size = input1.size();
+      configure(csf);
+
+      csf.output = [&log_odds](size_t input0_count, size_t input1_count,
+                               double value, const ev::StringRef& string) {
+        log_odds.emplace_back(value);
+      };
+
+      csf.FindSubstringFrequencies();
+    }
+
+    for (size_t top_k : {1, 10, 1000}) {
+      // Keep the `top_k` best lines for each input, in their original order.
+      std::vector<bool> keep(log_odds.size());
+
+      for (int input : {0, 1}) {
+        std::vector<size_t> indexes;
+        for (size_t i = 0; i < log_odds.size(); ++i) {
+          if ((log_odds[i] <= 0) == input) indexes.emplace_back(i);
+        }
+
+        std::stable_sort(indexes.begin(), indexes.end(),
+                         [&log_odds](size_t lhs, size_t rhs) {
+                           return std::fabs(log_odds[lhs]) >
+                                  std::fabs(log_odds[rhs]);
+                         });
+
+        for (size_t i = 0; i < std::min(top_k, indexes.size()); ++i)
+          keep[indexes[i]] = true;
+      }
+
+      std::vector<std::string> expected;
+      for (size_t i = 0; i < all.size(); ++i) {
+        if (keep[i]) expected.emplace_back(all[i]);
+      }
+
+      for (int threads : {1, 4}) {
+        CompareOutputs(expected,
+                       CollectOutput(input0, input1,
+                                     [&configure, top_k,
+                                      threads](CommonSubstringFinder& csf) {
+                                       configure(csf);
+                                       csf.top_k = top_k;
+                                       csf.threads = threads;
+                                     }));
+      }
+    }
+  }
+}
+
+void TestRedundantFeatures() {
+  std::minstd_rand rng(12);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 500);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 500);
+
+  struct Feature {
+    std::string substring;
+    double log_odds;
+    size_t input0_count;
+    size_t input1_count;
+  };
+
+  for (int do_document : {0, 1}) {
+    const auto configure = [do_document](CommonSubstringFinder& csf) {
+      csf.do_document = do_document;
+      csf.threshold_count = 2;
+    };
+
+    // Every candidate, with its exact log odds.
+    std::vector<Feature> candidates;
+
+    {
+      CommonSubstringFinder csf;
+      csf.input0 = input0.data();
+      csf.input0_size = input0.size();
+      csf.input1 = input1.data();
+      csf.input1_size = input1.size();
+      configure(csf);
+      csf.filter_redundant_features = 0;
+
+      csf.output = [&candidates](size_t input0_count, size_t input1_count,
+                                 double log_odds,
+                                 const ev::StringRef& string) {
+        candidates.push_back(
+            Feature{string.str(), log_odds, input0_count, input1_count});
+      };
+
+      csf.FindSubstringFrequencies();
+    }
+
+    // Compare each candidate to all the features found so far.  Features
+    // keep their log odds as float.
+    std::vector<Feature> features;
+
+    for (const auto& candidate : candidates) {
+      auto feature = std::find_if(
+          features.begin(), features.end(), [&candidate](const Feature& f) {
+            return (f.log_odds > 0) == (candidate.log_odds > 0) &&
+                   (f.substring.find(candidate.substring) != std::string::npos ||
+                    candidate.substring.find(f.substring) != std::string::npos);
+          });
+
+      if (feature == features.end()) {
+        features.push_back(candidate);
+        feature = features.end() - 1;
+      } else {
+        if (std::fabs(feature->log_odds) > std::fabs(candidate.log_odds))
+          continue;
+
+        if (std::fabs(feature->log_odds) == std::fabs(candidate.log_odds) &&
+            feature->substring.size() > candidate.substring.size())
+          continue;
+
+        *feature = candidate;
+      }
+
+      feature->log_odds = static_cast<float>(candidate.log_odds);
+    }
+
+    std::vector<std::string> expected;
+
+    for (const auto& feature : features) {
+      char prefix[64];
+      snprintf(prefix, sizeof(prefix), "%.3f\t%zu\t%zu\t", feature.log_odds,
+               feature.input0_count, feature.input1_count);
+      expected.emplace_back(prefix + feature.substring);
+    }
+
+    CompareOutputs(expected, CollectOutput(input0, input1, configure));
+  }
+}
+
+void TestSimilarFeatures() {
+  std::minstd_rand rng(14);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 500);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 500);
+
+  std::vector<std::string> documents;
+  for (const auto& input : {input0, input1}) {
+    for (size_t begin = 0, end; begin <= input.size(); begin = end + 1) {
+      end = std::min(input.find('\0', begin), input.size());
+      documents.emplace_back(input.substr(begin, end - begin));
+    }
+  }
+
+  const auto configure = [](CommonSubstringFinder& csf) {
+    csf.do_document = 1;
+    csf.threshold_count = 2;
+  };
+
+  const auto filtered = CollectOutput(input0, input1, configure);
+
+  for (double jaccard_threshold : {1.0, 0.5}) {
+    const auto configure_similar = [&configure, jaccard_threshold](
+        CommonSubstringFinder& csf) {
+      configure(csf);
+      csf.jaccard_threshold = jaccard_threshold;
+    };
+
+    const auto got = CollectOutput(input0, input1, configure_similar);
+
+    // Similar features are only removed, never added or reordered.
+    if (got.size() >= filtered.size()) abort();
+
+    for (size_t i = 0, j = 0; i < got.size(); ++i, ++j) {
+      while (j < filtered.size() && filtered[j] != got[i]) ++j;
+      if (j == filtered.size()) abort();
+    }
+
+    CompareOutputs(got, CollectOutput(input0, input1,
+                                      [&configure_similar](
+                                          CommonSubstringFinder& csf) {
+                                        configure_similar(csf);
+                                        csf.threads = 4;
+                                      }));
+
+    // Identical document sets always have identical signatures, so no two
+    // features with the same sign may have the same documents.
+    std::set<std::pair<bool, std::vector<bool>>> document_sets;
+
+    for (const auto& line : got) {
+      auto tab = line.find('\t');
+      tab = line.find('\t', tab + 1);
+      tab = line.find('\t', tab + 1);
+      const auto string = line.substr(tab + 1);
+
+      std::vector<bool> set;
+      for (const auto& document : documents)
+        set.emplace_back(document.find(string) != std::string::npos);
+
+      if (!document_sets.emplace(line[0] == '-', set).second) abort();
+    }
+  }
+}
+
+void TestCover() {
+  std::minstd_rand rng(15);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 500);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 500);
+
+  std::vector<std::string> documents;
+  for (size_t begin = 0, end; begin <= input0.size(); begin = end + 1) {
+    end = std::min(input0.find('\0', begin), input0.size());
+    documents.emplace_back(input0.substr(begin, end - begin));
+  }
+
+  for (int cover_threshold : {0, 2}) {
+    const auto configure = [cover_threshold](CommonSubstringFinder& csf) {
+      csf.do_document = 1;
+      csf.threshold_count = 2;
+      csf.cover_threshold = cover_threshold;
+    };
+
+    // The features to pick from, with their exact log odds.
+    std::vector<std::pair<double, std::string>> features;
+
+    {
+      CommonSubstringFinder csf;
+      csf.input0 = input0.data();
+      csf.input0_size = input0.size();
+      csf.input1 = input1.data();
+      csf.input1_size = input1.size();
+      configure(csf);
+
+      csf.output = [&features](size_t input0_count, size_t input1_count,
+                               double log_odds, const ev::StringRef& string) {
+        features.emplace_back(log_odds, string.str());
+      };
+
+      csf.FindSubstringFrequencies();
+    }
+
+    // Pick the feature covering the most remaining documents until all are
+    // covered, preferring positive log odds, then higher log odds.
+    std::vector<bool> covered(documents.size());
+    std::vector<bool> used(features.size());
+    std::vector<std::string> expected;
+
+    for (;;) {
+      size_t best = features.size(), best_coverage = 0;
+
+      for (size_t i = 0; i < features.size(); ++i) {
+        if (used[i]) continue;
+
+        size_t coverage = 0;
+        for (size_t j = 0; j < documents.size(); ++j) {
+          if (!covered[j] &&
+              documents[j].find(features[i].second) != std::string::npos)
+            ++coverage;
+        }
+
+        if (!coverage) continue;
+
+        if (best != features.size()) {
+          const auto positive = features[i].first > 0;
+          const auto best_positive = features[best].first > 0;
+          if (positive != best_positive) {
+            if (!positive) continue;
+          } else if (coverage != best_coverage) {
+            if (coverage < best_coverage) continue;
+          } else if (features[i].first <= features[best].first) {
+            continue;
+          }
+        }
+
+        best = i;
+        best_coverage = coverage;
+      }
+
+      if (best == features.size()) break;
+
+      used[best] = true;
+
+      for (size_t j = 0; j < documents.size(); ++j) {
+        if (documents[j].find(features[best].second) != std::string::npos)
+          covered[j] = true;
+      }
+
+      if (best_coverage > static_cast<size_t>(cover_threshold)) {
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%.3f\t%zu\t0\t",
+                 features[best].first, best_coverage);
+        expected.emplace_back(prefix + features[best].second);
+      }
+    }
+
+    if (expected.empty()) abort();
+
+    for (int threads : {1, 4}) {
+      CompareOutputs(expected, CollectOutput(input0, input1,
+                                             [&configure, threads](
+                                                 CommonSubstringFinder& csf) {
+                                               configure(csf);
+                                               csf.do_cover = 1;
+                                               csf.threads = threads;
+                                             }));
+    }
+  }
+}
+
+void TestMaximal() {
+  std::minstd_rand rng(11);
+  const auto input0 =
+      MakeRandomDocuments(rng, {"foo", "bar", "baz", "x", "yy"}, 300);
+  const auto input1 =
+      MakeRandomDocuments(rng, {"foo", "bar", "quux", "x", "zz"}, 300);
+
+  std::string text = input0;
+  text.push_back(0);
+  text += input1;
+
+  // Counts the occurrences of `needle` in the inputs, overlapping or not.
+  const auto count = [&text](const std::string& needle) {
+    size_t result = 0;
+    for (auto i = text.find(needle); i != std::string::npos;
+         i = text.find(needle, i + 1))
+      ++result;
+    return result;
+  };
+
+  for (auto engine :
+       {EnumerationEngine::kScan, EnumerationEngine::kIntervals}) {
+    const auto configure = [engine](CommonSubstringFinder& csf) {
+      csf.filter_redundant_features = 0;
+      csf.threshold_count = 2;
+      csf.max_length = 12;
+      csf.enumeration_engine = engine;
+    };
+
+    std::set<std::string> all;
+    std::vector<std::string> expected;
+
+    for (const auto& line : CollectOutput(input0, input1, configure))
+      all.emplace(line.substr(line.rfind('\t') + 1));
+
+    // The inputs are ASCII, so extending a substring by one character adds
+    // one byte.  Extensions with the same count have the same occurrences,
+    // and are reported too if short enough.
+    for (const auto& line : CollectOutput(input0, input1, configure)) {
+      const auto substring = line.substr(line.rfind('\t') + 1);
+      const auto substring_count = count(substring);
+      bool maximal = true;
+
+      for (const auto& extension : all) {
+        if (extension.size() == substring.size() + 1 &&
+            (!extension.compare(0, substring.size(), substring) ||
+             !extension.compare(1, substring.size(), substring)) &&
+            count(extension) == substring_count)
+          maximal = false;
+      }
+
+      if (maximal) expected.emplace_back(line);
+    }
+
+    CompareOutputs(expected,
+                   CollectOutput(input0, input1,
+                                 [&configure](CommonSubstringFinder& csf) {
+                                   configure(csf);
+                                   csf.do_maximal = 1;
+                                 }));
+  }
+
+  for (int do_document : {0, 1}) {
+    for (int do_color : {0, 1}) {
+      for (int do_words : {0, 1}) {
+        const auto configure = [=](CommonSubstringFinder& csf) {
+          csf.do_document = do_document;
+          csf.do_color = do_color;
+          csf.do_words = do_words;
+          csf.do_maximal = 1;
+          csf.threshold_count = 2;
+          csf.enumeration_engine = EnumerationEngine::kScan;
+        };
+
+        CompareOutputs(input0, input1, configure,
+                       [&configure](CommonSubstringFinder& csf) {
+                         configure(csf);
+                         csf.enumeration_engine = EnumerationEngine::kIntervals;
+                       });
+      }
+    }
+  }
+}
+
+void TestAppendDocuments() {
+  std::minstd_rand rng(5);
+  const auto input0 = MakeRandomDocuments(
+      rng, {"foo", "bar", "baz", "h\xc3\xa9llo", "x", "yy"}, 300);
+  const auto input1 = MakeRandomDocuments(
+      rng, {"foo", "bar", "quux", "h\xc3\xa9llo", "x", "zz"}, 300);
+
+  // Repeating the last documents makes existing suffixes that reached the
+  // end of the text tie with the new ones.
+  const auto tail = input1.substr(input1.rfind('\0', input1.size() - 40) + 1);
+  const auto appended =
+      tail + std::string(1, 0) + tail + std::string(1, 0) +
+      MakeRandomDocuments(rng, {"foo", "quux", "h\xc3\xa9llo", "zz"}, 30);
+
+  for (int do_document : {0, 1}) {
+    for (int do_words : {0, 1}) {
+      for (auto engine :
+           {SuffixArrayEngine::kDivSufSort, SuffixArrayEngine::kBounded}) {
+        const auto configure = [=](CommonSubstringFinder& csf) {
+          csf.do_document = do_document;
+          csf.do_words = do_words;
+          csf.sa_engine = engine;
+          csf.threshold = 0.5;
+        };
+
+        CompareOutputs(
+            CollectOutput(input0, input1 + std::string(1, 0) + appended,
+                          configure),
+            CollectOutput(input0, input1,
+                          [&configure, &appended](CommonSubstringFinder& csf) {
+                            configure(csf);
+                            csf.AppendDocuments(appended.data(),
+                                                appended.size());
+                          }));
+
+        // Appending to an empty second input.
+        CompareOutputs(
+            CollectOutput(input0, appended, configure),
+            CollectOutput(input0, "",
+                          [&configure, &appended](CommonSubstringFinder& csf) {
+                            configure(csf);
+                            csf.AppendDocuments(appended.data(),
+                                                appended.size());
+                          }));
+      }
+    }
+  }
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -128,5 +960,40 @@ int main(int argc, char** argv) {
 
   TestUniqueStrings("abcabc", "abx", {"abc", "bc", "c"});
 
+  TestUniqueStrings("cccAcccBcccCccc", "ccd dcc ccd dcc dcd", {"ccc"}, true);
+
+  TestUniqueStrings("abcabc", "abx", {"abc", "bc", "c"}, true);
+
+  TestWords("foo bar food foo bar", "", {"foo", "bar", "foo bar"});
+
+  TestWords("foo bar\nfoo bar", "foo", {"bar", "foo bar"});
+
+  TestThreads();
+
+  TestIndexFile(false);
+  TestIndexFile(true);
+
+  TestMemoryLimit();
+
+  TestSuffixArrayEngines();
+
+  TestEnumerationEngines();
+
+  TestScoreBounds();
+
+  TestLengthWindow();
+
+  TestTopK();
+
+  TestRedundantFeatures();
+
+  TestSimilarFeatures();
+
+  TestCover();
+
+  TestMaximal();
+
+  TestAppendDocuments();
+
   return EXIT_SUCCESS;
 }